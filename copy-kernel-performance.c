@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <string.h>
+
+#include "delaymemcpy.h"
+
+#define ARRAY_SIZE 0x4000000 // 64MB
+
+/* Total number of bytes copied for each size, so that every
+   measurement takes roughly the same time. */
+#define BYTES_PER_SIZE 0x40000000 // 1GB
+
+/* Arrays declared as global, as this allows program to use more
+   memory. Aligned to page boundaries so other global variables don't
+   end up in same page. */
+char __attribute__ ((aligned (0x1000))) array[ARRAY_SIZE];
+char __attribute__ ((aligned (0x1000))) copy[ARRAY_SIZE];
+
+/* Returns the number of seconds taken to copy 'size' bytes over and
+   over, until BYTES_PER_SIZE bytes are copied, with 'copy_function'. */
+double time_copies(void *(*copy_function)(void *, void *, size_t), size_t size) {
+
+  struct timeval start, end, diff;
+  size_t count = BYTES_PER_SIZE / size;
+  size_t i;
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < count; i++)
+    copy_function(copy, array, size);
+  gettimeofday(&end, NULL);
+
+  timersub(&end, &start, &diff);
+  return diff.tv_sec + diff.tv_usec / 1e6;
+}
+
+void *libc_memcpy(void *dst, void *src, size_t size) {
+
+  return memcpy(dst, src, size);
+}
+
+int main(void) {
+
+  size_t sizes[] = { 0x1000, 0x10000, 0x100000, 0x400000, 0x1000000, ARRAY_SIZE };
+  int i;
+
+  initialize_delay_memcpy_data();
+
+  // use the copy kernel for every size
+  delay_memcpy_set_streaming_threshold(0);
+
+  memset(array, 1, ARRAY_SIZE);
+  memset(copy, 2, ARRAY_SIZE);
+
+  printf("%10s %12s %12s\n", "size", "memcpy", "kernel");
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    double libc = time_copies(libc_memcpy, sizes[i]);
+    double kernel = time_copies(delay_memcpy_copy_now, sizes[i]);
+    printf("%10zu %9.2fGB/s %9.2fGB/s\n", sizes[i],
+	   BYTES_PER_SIZE / libc / 1e9, BYTES_PER_SIZE / kernel / 1e9);
+  }
+
+  if (memcmp(array, copy, ARRAY_SIZE)) {
+    printf("Copy kernel produced wrong data!\n");
+    return 1;
+  }
+
+  return 0;
+}
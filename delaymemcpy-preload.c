@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include "delaymemcpy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Interposer that routes the large memcpy and memmove calls of an
+   existing program through the delay memcpy engine, without changing
+   the program:
+
+     LD_PRELOAD=./libdelaymemcpy-preload.so program
+
+   A call is handed to the engine (see delay_memcpy_in_context) when
+   it copies at least DELAY_MEMCPY_PRELOAD_MIN_SIZE bytes (256K by
+   default), both addresses are multiples of
+   DELAY_MEMCPY_PRELOAD_ALIGNMENT (16 by default), the ranges do not
+   overlap, and neither is on the stack of the calling thread, which
+   the fault handler runs on. Any other call goes to the libc function.
+   The engine then decides whether to keep the copy pending, unless
+   DELAY_MEMCPY_PRELOAD_MODE is "lazy" or "eager" (see
+   delay_memcpy_flags). Setting DELAY_MEMCPY_PRELOAD_STATS prints the engine statistics to
+   the standard error output at exit, to measure the savings, and
+   setting DELAY_MEMCPY_PRELOAD_TRACE to a file name records the fault
+   trace and writes it to that file at exit, to be replayed with
+   delaymemcpy-replay (see delay_memcpy_start_trace). The other
+   DELAY_MEMCPY_* variables of the engine apply as usual.
+
+   The engine built into the interposer calls the libc functions
+   directly (see PRELOAD_RENAMES in the Makefile), so that the copies
+   it performs, including in the fault handler, are never interposed.
+   Other calls made while a call is being handled, by libc or by the
+   engine, go to libc as well.
+
+   The kernel returns EFAULT, rather than faulting, on buffers involved
+   in pending copies. The pending copies involving the buffer of read,
+   write, pread and pwrite are therefore performed first, as are those
+   involving memory that is freed, reallocated or unmapped; other
+   system calls, and the ones libc makes internally (for instance in
+   fwrite), are not covered. The program must not install its own
+   handler for segmentation faults.
+ */
+
+#define DEFAULT_MIN_SIZE (256 * 1024)
+#define DEFAULT_ALIGNMENT 16
+
+static void *(*libc_memcpy)(void *dst, const void *src, size_t size);
+static void *(*libc_memmove)(void *dst, const void *src, size_t size);
+static void *(*libc_memcpy_chk)(void *dst, const void *src, size_t size, size_t dst_size);
+static void *(*libc_memmove_chk)(void *dst, const void *src, size_t size, size_t dst_size);
+static ssize_t (*libc_read)(int fd, void *buf, size_t count);
+static ssize_t (*libc_write)(int fd, const void *buf, size_t count);
+static ssize_t (*libc_pread)(int fd, void *buf, size_t count, off_t offset);
+static ssize_t (*libc_pwrite)(int fd, const void *buf, size_t count, off_t offset);
+static void (*libc_free)(void *ptr);
+static void *(*libc_realloc)(void *ptr, size_t size);
+static int (*libc_munmap)(void *addr, size_t length);
+
+static size_t min_size = DEFAULT_MIN_SIZE;
+static size_t alignment = DEFAULT_ALIGNMENT;
+
+/* Context the copies are registered in, which also makes the engine
+   safe to use from any thread. NULL until the engine is ready, and if
+   it could not be set up. */
+static delay_memcpy_context_t *context = NULL;
+
+/* Number of calls being handled by the calling thread, and bounds of
+   its stack (NULL until known). Initial exec, as they are read in the
+   fault handler and must never be allocated lazily. */
+static __thread unsigned int depth __attribute__((tls_model("initial-exec")));
+static __thread void *stack_low __attribute__((tls_model("initial-exec")));
+static __thread void *stack_high __attribute__((tls_model("initial-exec")));
+
+/* Looks up the libc definitions of the interposed functions, on the
+   first call of any of them. Calls made meanwhile, by dlsym itself,
+   go without: copies are made one byte at a time, input and output
+   go straight to the system calls, and memory is not freed.
+ */
+static void resolve_libc_symbols(void) {
+
+  static int resolved = 0;
+
+  if (resolved || depth)
+    return;
+
+  depth++;
+  libc_memcpy = dlsym(RTLD_NEXT, "memcpy");
+  libc_memmove = dlsym(RTLD_NEXT, "memmove");
+  libc_memcpy_chk = dlsym(RTLD_NEXT, "__memcpy_chk");
+  libc_memmove_chk = dlsym(RTLD_NEXT, "__memmove_chk");
+  libc_read = dlsym(RTLD_NEXT, "read");
+  libc_write = dlsym(RTLD_NEXT, "write");
+  libc_pread = dlsym(RTLD_NEXT, "pread");
+  libc_pwrite = dlsym(RTLD_NEXT, "pwrite");
+  libc_free = dlsym(RTLD_NEXT, "free");
+  libc_realloc = dlsym(RTLD_NEXT, "realloc");
+  libc_munmap = dlsym(RTLD_NEXT, "munmap");
+  depth--;
+  resolved = 1;
+}
+
+/* Copies 'size' bytes one at a time, for the calls made before
+   memcpy or memmove is found. Going through volatile pointers keeps
+   the compiler from turning the loop back into a call to memcpy.
+   Handles overlapping ranges.
+ */
+static void *copy_slowly(void *dst, const void *src, size_t size) {
+
+  volatile unsigned char *d = dst;
+  const volatile unsigned char *s = src;
+  size_t i;
+
+  if (d < s)
+    for (i = 0; i < size; i++)
+      d[i] = s[i];
+  else
+    for (i = size; i > 0; i--)
+      d[i - 1] = s[i - 1];
+  return dst;
+}
+
+/* Definitions of the libc functions called by the engine built into
+   the interposer (see PRELOAD_RENAMES in the Makefile). */
+
+void *delay_memcpy_libc_memcpy(void *dst, const void *src, size_t size) {
+
+  if (!libc_memcpy)
+    return copy_slowly(dst, src, size);
+  return libc_memcpy(dst, src, size);
+}
+
+ssize_t delay_memcpy_libc_read(int fd, void *buf, size_t count) {
+
+  if (!libc_read)
+    return syscall(SYS_read, fd, buf, count);
+  return libc_read(fd, buf, count);
+}
+
+ssize_t delay_memcpy_libc_write(int fd, const void *buf, size_t count) {
+
+  if (!libc_write)
+    return syscall(SYS_write, fd, buf, count);
+  return libc_write(fd, buf, count);
+}
+
+ssize_t delay_memcpy_libc_pread(int fd, void *buf, size_t count, off_t offset) {
+
+  if (!libc_pread)
+    return syscall(SYS_pread64, fd, buf, count, offset);
+  return libc_pread(fd, buf, count, offset);
+}
+
+ssize_t delay_memcpy_libc_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+
+  if (!libc_pwrite)
+    return syscall(SYS_pwrite64, fd, buf, count, offset);
+  return libc_pwrite(fd, buf, count, offset);
+}
+
+void delay_memcpy_libc_free(void *ptr) {
+
+  if (libc_free)
+    libc_free(ptr);
+}
+
+int delay_memcpy_libc_munmap(void *addr, size_t length) {
+
+  if (!libc_munmap)
+    return syscall(SYS_munmap, addr, length);
+  return libc_munmap(addr, length);
+}
+
+/* Returns TRUE (non-zero) if the range from 'ptr' to 'ptr+size-1'
+   overlaps the stack of the calling thread. The bounds are looked up
+   on the first call of each thread; if that fails, every range is
+   taken to be on the stack.
+ */
+static int on_stack(const void *ptr, size_t size) {
+
+  if (!stack_high) {
+    pthread_attr_t attr;
+    void *low = NULL;
+    size_t stack_size = 0;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+      pthread_attr_getstack(&attr, &low, &stack_size);
+      pthread_attr_destroy(&attr);
+    }
+    if (!stack_size)
+      return 1;
+    stack_low = low;
+    stack_high = low + stack_size;
+  }
+
+  return ptr < stack_high && ptr + size > stack_low;
+}
+
+/* Returns TRUE (non-zero) if a copy of 'size' bytes from 'src' to
+   'dst' is to be handed to the engine (see the policy above). Must be
+   called with 'depth' raised.
+ */
+static int delay_copy(void *dst, const void *src, size_t size) {
+
+  return depth == 1 && context && size >= min_size &&
+    (((uintptr_t) dst | (uintptr_t) src) & (alignment - 1)) == 0 &&
+    (dst + size <= src || src + size <= dst) &&
+    !on_stack(dst, size) && !on_stack(src, size);
+}
+
+/* Performs the pending copies involving the range from 'ptr' to
+   'ptr+size-1', before it is handed to the kernel or released. If
+   'released' is TRUE (non-zero), the pending copies to the range are
+   dropped first, as nobody will read them.
+ */
+static void settle_range(void *ptr, size_t size, int released) {
+
+  resolve_libc_symbols();
+  if (!context || !ptr || !size || depth)
+    return;
+
+  depth++;
+  if (released)
+    delay_memcpy_cancel(ptr, size);
+  delay_memcpy_sync(ptr, size);
+  depth--;
+}
+
+void *memcpy(void *dst, const void *src, size_t size) {
+
+  resolve_libc_symbols();
+  depth++;
+  if (delay_copy(dst, src, size))
+    delay_memcpy_in_context(context, dst, (void *) src, size);
+  else
+    delay_memcpy_libc_memcpy(dst, src, size);
+  depth--;
+  return dst;
+}
+
+void *memmove(void *dst, const void *src, size_t size) {
+
+  resolve_libc_symbols();
+  depth++;
+  if (delay_copy(dst, src, size))
+    delay_memcpy_in_context(context, dst, (void *) src, size);
+  else if (libc_memmove)
+    libc_memmove(dst, src, size);
+  else
+    copy_slowly(dst, src, size);
+  depth--;
+  return dst;
+}
+
+/* Checked versions, called by programs built with _FORTIFY_SOURCE.
+   Overflows are left to libc to report. */
+
+void *__memcpy_chk(void *dst, const void *src, size_t size, size_t dst_size) {
+
+  resolve_libc_symbols();
+  if (size > dst_size && libc_memcpy_chk)
+    return libc_memcpy_chk(dst, src, size, dst_size);
+  return memcpy(dst, src, size);
+}
+
+void *__memmove_chk(void *dst, const void *src, size_t size, size_t dst_size) {
+
+  resolve_libc_symbols();
+  if (size > dst_size && libc_memmove_chk)
+    return libc_memmove_chk(dst, src, size, dst_size);
+  return memmove(dst, src, size);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+
+  settle_range(buf, count, 0);
+  return delay_memcpy_libc_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+
+  settle_range((void *) buf, count, 0);
+  return delay_memcpy_libc_write(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+
+  settle_range(buf, count, 0);
+  return delay_memcpy_libc_pread(fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+
+  settle_range((void *) buf, count, 0);
+  return delay_memcpy_libc_pwrite(fd, buf, count, offset);
+}
+
+/* Only blocks of at least the minimum size can hold a copy handed to
+   the engine, so smaller ones are freed right away. */
+void free(void *ptr) {
+
+  resolve_libc_symbols();
+  if (ptr && context && !depth) {
+    size_t size = malloc_usable_size(ptr);
+    if (size >= min_size)
+      settle_range(ptr, size, 1);
+  }
+  delay_memcpy_libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+
+  resolve_libc_symbols();
+  if (ptr && context && !depth) {
+    size_t old_size = malloc_usable_size(ptr);
+    if (old_size >= min_size)
+      settle_range(ptr, old_size, 0);
+  }
+  return libc_realloc ? libc_realloc(ptr, size) : NULL;
+}
+
+int munmap(void *addr, size_t length) {
+
+  settle_range(addr, length, 1);
+  return delay_memcpy_libc_munmap(addr, length);
+}
+
+/* Prints the engine statistics, if requested. */
+static void print_stats(void) {
+
+  delay_memcpy_stats_t stats;
+
+  depth++;
+  delay_memcpy_get_stats(&stats);
+  fprintf(stderr,
+	  "delaymemcpy: %lu copies registered (%lu bytes), %lu eager, "
+	  "%lu bytes copied, %lu bytes never copied, %lu faults\n",
+	  stats.copies_registered, stats.bytes_registered, stats.copies_eager,
+	  stats.bytes_copied, stats.bytes_never_copied,
+	  stats.faults_src_read + stats.faults_dst_read + stats.faults_write);
+  depth--;
+}
+
+/* Writes the fault trace to the file named by
+   DELAY_MEMCPY_PRELOAD_TRACE, at exit.
+ */
+static void dump_trace(void) {
+
+  const char *path = getenv("DELAY_MEMCPY_PRELOAD_TRACE");
+  int fd;
+
+  depth++;
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || delay_memcpy_dump_trace(fd) < 0)
+    fprintf(stderr, "delaymemcpy: cannot write the trace to %s\n", path);
+  if (fd >= 0)
+    close(fd);
+  depth--;
+}
+
+/* Reads the settings and starts the engine, before the program runs.
+   The engine stays unused if it cannot be set up.
+ */
+__attribute__((constructor))
+static void initialize_preload(void) {
+
+  const char *value;
+  int flags = DELAY_MEMCPY_AUTO;
+
+  resolve_libc_symbols();
+
+  value = getenv("DELAY_MEMCPY_PRELOAD_MIN_SIZE");
+  if (value)
+    min_size = strtoul(value, NULL, 0);
+  value = getenv("DELAY_MEMCPY_PRELOAD_ALIGNMENT");
+  if (value && strtoul(value, NULL, 0) > 0)
+    alignment = strtoul(value, NULL, 0);
+  if (alignment & (alignment - 1))
+    alignment = DEFAULT_ALIGNMENT;
+  value = getenv("DELAY_MEMCPY_PRELOAD_MODE");
+  if (value && !strcmp(value, "lazy"))
+    flags = DELAY_MEMCPY_LAZY;
+  else if (value && !strcmp(value, "eager"))
+    flags = DELAY_MEMCPY_EAGER;
+
+  depth++;
+  initialize_delay_memcpy_data();
+  context = delay_memcpy_create_context(flags);
+  depth--;
+
+  if (context && getenv("DELAY_MEMCPY_PRELOAD_STATS"))
+    atexit(print_stats);
+
+  // the engine may already be recording, with the size of DELAY_MEMCPY_TRACE
+  if (context && getenv("DELAY_MEMCPY_PRELOAD_TRACE") &&
+      (getenv("DELAY_MEMCPY_TRACE") || delay_memcpy_start_trace(0) == 0))
+    atexit(dump_trace);
+}
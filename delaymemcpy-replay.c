@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "delaymemcpy.h"
+
+/* Replays a fault trace recorded by the engine (see
+   delay_memcpy_start_trace) against the engine of this program: the
+   copies, syncs, cancels and flushes are requested again in the same
+   order, and each recorded fault becomes an access to the same
+   address, of the same kind, which may or may not fault this time.
+   The statistics of the engine are written at the end, so that the
+   same trace can be replayed with other settings, or against another
+   build of the engine, and the results compared. Accesses that did
+   not fault when recording are unknown, and so left out.
+
+   The addresses of the trace are moved to fresh memory: the ranges
+   involved are rounded to ALIGNMENT, merged, and each is mapped at a
+   new address of the same alignment, so that addresses keep their
+   offsets within pages of any size up to ALIGNMENT.
+
+   Usage: delaymemcpy-replay [-g granularity] [-a min,max] [-m mode]
+                             [-b sigsegv|userfaultfd] [-t threads] [-z] trace
+
+   -g sets the page size of the engine (the recorded one by default),
+   -a the fault-ahead window in bytes, -m forces the mode of every
+   copy (auto, eager, lazy or drain) rather than the recorded one, -b
+   the backend, -t the number of flush threads, and -z looks for zero
+   pages (see delay_memcpy_set_zero_pages). Sizes take a K, M or G
+   suffix.
+ */
+
+#define ALIGNMENT 0x200000 // 2MB
+
+/* Range of the trace moved to a new address */
+typedef struct region {
+  uint64_t start;
+  uint64_t end;
+  char *base;
+} region_t;
+
+delay_memcpy_trace_event_t *events;
+size_t num_events;
+region_t *regions;
+size_t num_regions;
+
+/* Parses a size with an optional K, M or G suffix. */
+size_t parse_size(const char *text) {
+
+  char *end;
+  size_t size = strtoull(text, &end, 0);
+
+  switch (*end) {
+  case 'K': case 'k': return size << 10;
+  case 'M': case 'm': return size << 20;
+  case 'G': case 'g': return size << 30;
+  }
+  return size;
+}
+
+/* Adds the range of 'size' bytes at 'start' to the regions to map,
+   rounded to ALIGNMENT. Regions are merged later on. */
+void add_region(uint64_t start, uint64_t size) {
+
+  if (size == 0 || start == 0)
+    return;
+
+  regions[num_regions].start = start & -(uint64_t) ALIGNMENT;
+  regions[num_regions].end = (start + size + ALIGNMENT - 1) & -(uint64_t) ALIGNMENT;
+  num_regions++;
+}
+
+int compare_regions(const void *a, const void *b) {
+
+  const region_t *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Sorts and merges the regions, and maps each of them at a new
+   address aligned to ALIGNMENT, filled with data that is not all
+   zeros. Returns 0 on success, or -1 on failure. */
+int map_regions(void) {
+
+  size_t i, count = 0;
+
+  qsort(regions, num_regions, sizeof(*regions), compare_regions);
+  for (i = 0; i < num_regions; i++) {
+    if (count > 0 && regions[i].start <= regions[count - 1].end) {
+      if (regions[i].end > regions[count - 1].end)
+	regions[count - 1].end = regions[i].end;
+    }
+    else
+      regions[count++] = regions[i];
+  }
+  num_regions = count;
+
+  for (i = 0; i < num_regions; i++) {
+
+    size_t size = regions[i].end - regions[i].start;
+    char *area = mmap(NULL, size + ALIGNMENT, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED)
+      return -1;
+
+    regions[i].base = (char *) (((uintptr_t) area + ALIGNMENT - 1) & -(uintptr_t) ALIGNMENT);
+    memset(regions[i].base, 0x5a, size);
+  }
+  return 0;
+}
+
+/* Returns the new address of address 'addr' of the trace. */
+void *translate(uint64_t addr) {
+
+  size_t low = 0, high = num_regions;
+
+  while (high - low > 1) {
+    size_t middle = (low + high) / 2;
+    if (regions[middle].start <= addr)
+      low = middle;
+    else
+      high = middle;
+  }
+  return regions[low].base + (addr - regions[low].start);
+}
+
+/* Reads the trace in file 'path'. Returns the granularity it was
+   recorded with, or 0 on failure. */
+size_t read_trace(const char *path) {
+
+  delay_memcpy_trace_header_t header;
+  FILE *file = fopen(path, "rb");
+
+  if (!file) {
+    perror(path);
+    return 0;
+  }
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, DELAY_MEMCPY_TRACE_MAGIC, sizeof(header.magic))) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    fclose(file);
+    return 0;
+  }
+
+  num_events = header.events;
+  events = malloc(num_events * sizeof(*events) + 1);
+  if (!events || fread(events, sizeof(*events), num_events, file) != num_events) {
+    fprintf(stderr, "%s: truncated trace\n", path);
+    fclose(file);
+    return 0;
+  }
+  fclose(file);
+
+  if (header.dropped)
+    fprintf(stderr, "%s: %llu older events were dropped when recording\n",
+	    path, (unsigned long long) header.dropped);
+  return header.granularity;
+}
+
+/* Writes how to run the program. Returns the exit status. */
+int usage(const char *program) {
+
+  fprintf(stderr, "Usage: %s [-g granularity] [-a min,max] [-m auto|eager|lazy|drain] "
+	  "[-b sigsegv|userfaultfd] [-t threads] [-z] trace\n", program);
+  return 1;
+}
+
+/* Returns the current time of the monotonic clock, in nanoseconds. */
+uint64_t now(void) {
+
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+
+  size_t granularity = 0, ahead_min = 0, ahead_max = 0;
+  int mode = -1, backend = DELAY_MEMCPY_BACKEND_SIGSEGV, zero_pages = 0, drained = 0;
+  unsigned int threads = 1;
+  unsigned long recorded_faults = 0;
+  delay_memcpy_stats_t stats;
+  uint64_t start, elapsed;
+  size_t recorded_granularity, i;
+  const char *modes[] = { "auto", "eager", "lazy", "drain" };
+  char *end;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "g:a:m:b:t:z")) != -1) {
+    switch (opt) {
+    case 'g': granularity = parse_size(optarg); break;
+    case 'a':
+      ahead_min = parse_size(optarg);
+      ahead_max = strchr(optarg, ',') ? parse_size(strchr(optarg, ',') + 1) : ahead_min;
+      break;
+    case 'm':
+      for (mode = 3; mode >= 0 && strcmp(optarg, modes[mode]); mode--);
+      if (mode < 0)
+	return usage(argv[0]);
+      break;
+    case 'b':
+      if (!strcmp(optarg, "sigsegv"))
+	backend = DELAY_MEMCPY_BACKEND_SIGSEGV;
+      else if (!strcmp(optarg, "userfaultfd"))
+	backend = DELAY_MEMCPY_BACKEND_USERFAULTFD;
+      else
+	return usage(argv[0]);
+      break;
+    case 't':
+      threads = strtoul(optarg, &end, 0);
+      if (*end || threads == 0)
+	return usage(argv[0]);
+      break;
+    case 'z': zero_pages = 1; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    return usage(argv[0]);
+
+  recorded_granularity = read_trace(argv[optind]);
+  if (!recorded_granularity)
+    return 1;
+
+  regions = malloc((2 * num_events + 1) * sizeof(*regions));
+  if (!regions) {
+    fprintf(stderr, "Cannot allocate the regions of the trace\n");
+    return 1;
+  }
+  for (i = 0; i < num_events; i++) {
+    delay_memcpy_trace_event_t *event = &events[i];
+    if (event->type == DELAY_MEMCPY_TRACE_COPY && event->flags == DELAY_MEMCPY_DRAIN)
+      drained = 1;
+    if (event->type == DELAY_MEMCPY_TRACE_FAULT) {
+      add_region(event->addr, 1);
+      recorded_faults++;
+    }
+    else {
+      add_region(event->dst, event->size);
+      if (event->type == DELAY_MEMCPY_TRACE_COPY)
+	add_region(event->src, event->size);
+    }
+  }
+  if (num_regions == 0 || map_regions() < 0) {
+    fprintf(stderr, "Cannot map the memory of the trace\n");
+    return 1;
+  }
+
+  initialize_delay_memcpy_data();
+  if (backend != DELAY_MEMCPY_BACKEND_SIGSEGV && delay_memcpy_set_backend(backend) < 0) {
+    fprintf(stderr, "Backend not available\n");
+    return 1;
+  }
+  if (delay_memcpy_set_granularity(granularity ? granularity : recorded_granularity) < 0) {
+    fprintf(stderr, "Invalid granularity\n");
+    return 1;
+  }
+  if (ahead_max)
+    delay_memcpy_set_fault_ahead(ahead_min, ahead_max);
+  if (delay_memcpy_set_flush_threads(threads) < 0) {
+    fprintf(stderr, "Invalid number of flush threads\n");
+    return 1;
+  }
+  delay_memcpy_set_zero_pages(zero_pages);
+  if (mode == DELAY_MEMCPY_DRAIN || (mode < 0 && drained))
+    delay_memcpy_start_drain(0, -1);
+  delay_memcpy_reset_stats();
+
+  start = now();
+  for (i = 0; i < num_events; i++) {
+
+    delay_memcpy_trace_event_t *event = &events[i];
+    volatile char *byte;
+
+    switch (event->type) {
+    case DELAY_MEMCPY_TRACE_COPY:
+      delay_memcpy_flags(translate(event->dst), translate(event->src), event->size,
+			 mode >= 0 ? mode : (int) event->flags);
+      break;
+    case DELAY_MEMCPY_TRACE_FAULT:
+      byte = translate(event->addr);
+      if (event->flags & DELAY_MEMCPY_TRACE_WRITE)
+	*byte = *byte;
+      else
+	(void) *byte;
+      break;
+    case DELAY_MEMCPY_TRACE_SYNC:
+      delay_memcpy_sync(translate(event->dst), event->size);
+      break;
+    case DELAY_MEMCPY_TRACE_CANCEL:
+      delay_memcpy_cancel(translate(event->dst), event->size);
+      break;
+    case DELAY_MEMCPY_TRACE_FLUSH:
+      delay_memcpy_flush_all();
+      break;
+    }
+  }
+  delay_memcpy_flush_all();
+  elapsed = now() - start;
+
+  delay_memcpy_get_stats(&stats);
+  printf("events,%zu\n", num_events);
+  printf("elapsed_ns,%llu\n", (unsigned long long) elapsed);
+  printf("faults_recorded,%lu\n", recorded_faults);
+  printf("faults,%lu\n", stats.faults_src_read + stats.faults_dst_read + stats.faults_write);
+  printf("faults_src_read,%lu\n", stats.faults_src_read);
+  printf("faults_dst_read,%lu\n", stats.faults_dst_read);
+  printf("faults_write,%lu\n", stats.faults_write);
+  printf("faults_avoided,%lu\n", stats.faults_avoided);
+  printf("copies_registered,%lu\n", stats.copies_registered);
+  printf("copies_eager,%lu\n", stats.copies_eager);
+  printf("bytes_copied,%lu\n", stats.bytes_copied);
+  printf("bytes_never_copied,%lu\n", stats.bytes_never_copied);
+  printf("splits,%lu\n", stats.splits);
+  printf("forced_evictions,%lu\n", stats.forced_evictions);
+  printf("peak_pending_copies,%lu\n", stats.peak_pending_copies);
+  for (i = 0; i < DELAY_MEMCPY_LATENCY_BUCKETS; i++)
+    if (stats.fault_latency[i])
+      printf("fault_latency_%lluns,%lu\n", 1ULL << i, stats.fault_latency[i]);
+
+  return 0;
+}
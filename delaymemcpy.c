@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "delaymemcpy.h"
 
 #include <stdio.h>
@@ -9,43 +10,550 @@
 #include <string.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-#define MAX_PENDING_COPIES 50
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_STREAMING_COPY 1
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/userfaultfd.h>)
+#include <linux/userfaultfd.h>
+#define HAVE_USERFAULTFD 1
+#endif
+#endif
+
+/* Default maximum number of pending copies. Once reached, the oldest
+   pending copy is performed to make room for a new one. Can be changed
+   with delay_memcpy_set_capacity.
+ */
+#define DEFAULT_MAX_PENDING_COPIES 65536
+
+/* Minimum number of free pending copy objects kept available for the
+   signal handler, which splits copies but cannot allocate memory.
+ */
+#define PENDING_COPY_SLACK 64
+
+/* Average number of page index entries reserved for each pending copy
+   object. A copy is indexed with one entry per aligned block of pages
+   covering its source and destination (see page_index_add), so most
+   copies use only a handful of them.
+ */
+#define PAGE_INDEX_ENTRIES_PER_COPY 64
+
+/* Initial number of buckets in the page index hash table, as a power
+   of two. The table doubles whenever it holds more than two entries
+   per bucket.
+ */
+#define PAGE_INDEX_INITIAL_BUCKET_BITS 12
+
+/* Number of possible block sizes (in powers of two pages) in the page
+   index.
+ */
+#define PAGE_INDEX_LEVELS 64
+
+/* Default largest window, in bytes, performed at once when the pages
+   of a pending copy are touched in sequence (see
+   delay_memcpy_set_fault_ahead).
+ */
+#define DEFAULT_FAULT_AHEAD_MAX (1024 * 1024)
+
+/* Default size, in bytes, from which copies are performed with
+   non-temporal stores (see delay_memcpy_set_streaming_threshold).
+ */
+#define DEFAULT_STREAMING_THRESHOLD (4 * 1024 * 1024)
+
+/* Fraction, in thousandths, of the bytes of lazy copies assumed to be
+   performed in the end, for the bytes not observed yet (see
+   choose_copy_mode).
+ */
+#define DEFAULT_TOUCH_RATIO 100
+
+/* Number of bytes of lazy copies to observe before relying on the
+   observed touch ratio alone. Past twice as many, the observations are
+   halved, so that older ones fade out.
+ */
+#define TOUCH_RATIO_WINDOW (64 * 1024 * 1024)
+
+/* Minimum touch ratio, in thousandths, for automatic copies to be
+   handed to the background drain thread rather than left for the
+   faults.
+ */
+#define DRAIN_MIN_TOUCH_RATIO 250
+
+/* Number of consecutive copies performed right away, while keeping
+   them pending would have been cheaper if they were never touched,
+   after which one is kept pending anyway to observe the touch ratio
+   again.
+ */
+#define EXPLORE_INTERVAL 16
+
+/* Size of the copy used to calibrate the cost model, before rounding
+   up to whole pages.
+ */
+#define CALIBRATION_SIZE (256 * 1024)
+
+/* Default number of events kept by the fault trace (see
+   delay_memcpy_start_trace).
+ */
+#define DEFAULT_TRACE_EVENTS (1024 * 1024)
+
+/* Size of the chunks into which delay_memcpy_flush_all slices the
+   pending copies for its workers, and minimum number of bytes those
+   copies must add up to for the workers to be started at all.
+ */
+#define FLUSH_CHUNK_SIZE (512 * 1024)
+#define FLUSH_PARALLEL_MIN (4 * 1024 * 1024)
+
+/* Maximum number of threads performing a flush (see
+   delay_memcpy_set_flush_threads).
+ */
+#define MAX_FLUSH_THREADS 256
+
+struct pending_copy;
+
+/* Entry of the page index. Each entry states that the pages from
+   block << level to ((block + 1) << level) - 1 contain part of the
+   source or destination of a pending copy.
+ */
+typedef struct page_index_entry {
+
+  uintptr_t block;
+  unsigned int level;
+
+  /* Flag to indicate if the pages contain the destination (rather
+     than the source) of the copy */
+  unsigned int is_dst:1;
+
+  struct pending_copy *copy;
+
+  /* Links of the hash bucket chain. pprev points to the pointer that
+     points to this entry, so entries can be removed in constant time */
+  struct page_index_entry *next;
+  struct page_index_entry **pprev;
+
+  /* Links of the list of entries with the same level */
+  struct page_index_entry *level_next;
+  struct page_index_entry **level_pprev;
+
+  /* Next entry belonging to the same pending copy */
+  struct page_index_entry *next_of_copy;
+
+} page_index_entry_t;
 
 /* Data structure use to keep a list of pending memory copies. */
 typedef struct pending_copy {
 
   /* Flag to indicate if this pending copy object is in use or free */
   unsigned int in_use:1;
+
+  /* How the destination is kept from being accessed before the copy
+     is performed (one of the PENDING_COPY_* values below) */
+  unsigned int kind:3;
+
+  /* Flag to indicate that the background drain thread should perform
+     the copy (see DELAY_MEMCPY_DRAIN) */
+  unsigned int drain:1;
+
+  /* Context the copy was registered in (see delay_memcpy_create_context),
+     or NULL */
+  struct delay_memcpy_context *context;
+
+  /* File read by a copy of kind PENDING_COPY_FILE, or byte written
+     by one of kind PENDING_COPY_FILL, and -1 for other kinds */
+  int operand;
   
   /* Source, destination and size of the memory regions involved in the copy */
   void *src;
   void *dst;
   size_t size;
 
-  /* Next pending copy. NULL if there is no other pending copy */
+  /* Order in which the copy was requested. Copies split from the same
+     request share the same sequence number.
+   */
+  unsigned long seq;
+
+  /* Number of pages performed on the last fault on this copy, or 0 if
+     there was none, and page whose fault would continue the same
+     sequence */
+  size_t fault_window;
+  uintptr_t next_fault_page;
+
+  /* Next and previous pending copies. NULL if there is no other pending copy */
   struct pending_copy *next;
+  struct pending_copy *prev;
+
+  /* Next and previous pending copies to be drained, in the order of
+     the list, if the drain flag is set. NULL if there is no other */
+  struct pending_copy *drain_next;
+  struct pending_copy *drain_prev;
+
+  /* Next and previous copies of the fan-out ring of this copy: the
+     pending copies of the same source and size into other
+     destinations, in the order they were requested (see
+     perform_fanout). A copy outside of any ring links to itself */
+  struct pending_copy *fanout_next;
+  struct pending_copy *fanout_prev;
+
+  /* Page index entries for the source and destination of this copy */
+  page_index_entry_t *index_entries;
   
 } pending_copy_t;
 
-/* First element of the pending copy linked list. The order of the
- * list matters: if two or more copies have overlapping regions, they
- * must be performed in the order of the list.
+/* Kinds of pending copies:
+
+   - PENDING_COPY_PROTECTED: the destination pages are protected, and
+     copied in the segmentation fault handler when touched.
+
+   - PENDING_COPY_MISSING: the destination pages were dropped, and are
+     filled through userfaultfd when touched.
+
+   - PENDING_COPY_REMAPPED: the destination pages are a private
+     mapping of the source pages (see delay_memcpy_alloc), so they
+     already show the data. The copy is only performed, by giving
+     them their own copy of the pages, before the source is written.
+
+   - PENDING_COPY_FILE: the destination pages are protected like
+     PENDING_COPY_PROTECTED, and read from a file when touched (see
+     delay_read_fd). The source is the offset in the file rather
+     than an address, and is left out of the page index.
+
+   - PENDING_COPY_FILL: the destination pages are protected like
+     PENDING_COPY_PROTECTED, and filled with a byte when touched (see
+     delay_memset). There is no source.
+
+   The destination of the second and third kinds is page aligned.
+ */
+#define PENDING_COPY_PROTECTED 0
+#define PENDING_COPY_MISSING 1
+#define PENDING_COPY_REMAPPED 2
+#define PENDING_COPY_FILE 3
+#define PENDING_COPY_FILL 4
+
+/* Returns TRUE (non-zero) if pending copies of kind 'kind' read from
+   memory, and so have their source in the page index. */
+static int reads_memory(int kind) {
+
+  return kind <= PENDING_COPY_REMAPPED;
+}
+
+/* Returns TRUE (non-zero) if the destination pages of pending copies
+   of kind 'kind' are protected until performed. */
+static int protects_destination(int kind) {
+
+  return kind == PENDING_COPY_PROTECTED || kind >= PENDING_COPY_FILE;
+}
+
+/* First and last elements of the pending copy linked list. The order
+ * of the list matters: if two or more copies have overlapping regions,
+ * they must be performed in the order of the list.
  */
 static pending_copy_t *first_pending_copy = NULL;
+static pending_copy_t *last_pending_copy = NULL;
 
-/* Array of possible pending copies pointers. Because malloc/free are
-   not async-safe they cannot safely be called inside a signal
-   handler, so an array of objects is created, and the in_use flag is
-   used to determine which objects are in use.
+/* Sequence number of the most recently requested copy. */
+static unsigned long last_copy_seq = 0;
+
+/* Arena of fixed-size objects. Because malloc/free are not
+   async-safe they cannot safely be called inside a signal handler, so
+   objects are carved from slabs mapped with mmap outside of the
+   handler, and kept in a lock-free free list that can be used from
+   anywhere. The free list head is a pointer tagged with a counter in
+   its upper bits to avoid the ABA problem; slabs are never unmapped,
+   so reading the link of an object that was concurrently taken is
+   harmless.
+ */
+typedef struct slab_arena {
+
+  /* Size of the objects, and offset of the pointer used to link free
+     objects together */
+  size_t object_size;
+  size_t link_offset;
+
+  /* Tagged pointer to the first free object */
+  uint64_t free_list;
+
+  /* Number of free objects, and total number of objects in the slabs */
+  size_t free_count;
+  size_t capacity;
+
+} slab_arena_t;
+
+#define ARENA_TAG_SHIFT 48
+#define ARENA_POINTER_MASK ((1ULL << ARENA_TAG_SHIFT) - 1)
+
+/* Arena of pending copy objects. */
+static slab_arena_t pending_copy_arena = { sizeof(pending_copy_t), offsetof(pending_copy_t, next) };
+
+/* Number of pending copy objects in use, and maximum allowed. */
+static size_t pending_copies_in_use = 0;
+static size_t max_pending_copies = DEFAULT_MAX_PENDING_COPIES;
+
+/* Page index used by the signal handler to find the pending copies
+   involving a page without going through the whole list. A copy's
+   source and destination are each split into maximal aligned blocks
+   of 2^level pages, and each block is stored in a hash table keyed by
+   (level, block). Looking up a page then takes one hash probe per
+   level in use, independently of the number of pending copies. The
+   entries are preallocated for the same reason as the copy slots.
+ */
+static page_index_entry_t **page_index_buckets = NULL;
+static unsigned int page_index_bucket_bits = 0;
+static slab_arena_t page_index_arena = { sizeof(page_index_entry_t), offsetof(page_index_entry_t, next) };
+
+/* Entries of each level, number of entries in each level, and bit
+   mask of the levels with at least one entry.
  */
-static pending_copy_t pending_copy_slots[MAX_PENDING_COPIES];
+static page_index_entry_t *page_index_level_entries[PAGE_INDEX_LEVELS];
+static unsigned int page_index_level_count[PAGE_INDEX_LEVELS];
+static uint64_t page_index_levels = 0;
 
-/* Global variable to keep the current page size. Initialized in
+/* Global variable to keep the current page size. This is the unit in
+   which pending copies are tracked, protected and split: the system
+   page size, unless a larger granularity was selected with
+   delay_memcpy_set_granularity. Initialized in
    initialize_delay_memcpy_data.
  */
 static long page_size = 0;
 
+/* Base two logarithm of page_size. */
+static unsigned int page_shift = 0;
+
+/* Size of the pages of the system, and its base two logarithm. */
+static long system_page_size = 0;
+static unsigned int system_page_shift = 0;
+
+/* Smallest and largest number of pages performed on a fault (see
+   delay_memcpy_set_fault_ahead). The largest one is set in
+   initialize_delay_memcpy_data, once the page size is known.
+ */
+static size_t fault_ahead_min = 1;
+static size_t fault_ahead_max = 1;
+
+/* Counters of the engine (see delay_memcpy_get_stats). They are only
+   changed with atomic operations, so they can be updated from the
+   signal handler and read at any time without taking the engine.
+ */
+static delay_memcpy_stats_t stats;
+
+#define STAT_ADD(counter, value) __atomic_add_fetch(&stats.counter, value, __ATOMIC_RELAXED)
+
+/* Ring buffer of the fault trace (see delay_memcpy_start_trace), the
+   number of events it holds, or 0 if the trace is off, and the number
+   of events recorded since it was started. Only changed with the
+   engine lock held, so events can be recorded from the signal handler
+   without any other synchronization.
+ */
+static delay_memcpy_trace_event_t *trace_events = NULL;
+static size_t trace_capacity = 0;
+static uint64_t trace_recorded = 0;
+
+/* Copy kernel used for copies of at least streaming_threshold bytes,
+   selected in initialize_delay_memcpy_data according to the
+   instruction sets of the CPU. NULL if there is none, in which case
+   every copy uses memcpy.
+ */
+static void (*streaming_copy)(void *dst, void *src, size_t size) = NULL;
+static size_t streaming_threshold = DEFAULT_STREAMING_THRESHOLD;
+
+/* Function telling whether a range holds only zeros, selected like
+   the streaming copy kernel. */
+static int is_zero_generic(void *ptr, size_t size);
+static int (*is_zero)(void *ptr, size_t size) = is_zero_generic;
+
+/* Flag to leave destination pages whose source is all zeros to read
+   as zeros rather than copy them (see delay_memcpy_set_zero_pages) */
+static int zero_pages = 0;
+
+/* Number of threads, the caller included, among which
+   delay_memcpy_flush_all spreads the pending copies. */
+static unsigned int flush_threads = 1;
+
+/* Cost model used to choose how to perform each copy (see
+   choose_copy_mode): the time to copy a byte right away, the time to
+   register a pending copy, and the time to perform a byte of a
+   pending copy from the fault handlers, including the fault itself.
+   Calibrated in initialize_delay_memcpy_data; the fault cost then
+   follows the observed faults.
+ */
+static uint64_t copy_ps_per_byte = 100;
+static uint64_t register_ns = 10000;
+static uint64_t fault_ps_per_byte = 2000;
+
+/* Bytes of copies kept pending, and bytes of those that were performed
+   in the end, from which the touch ratio is estimated. Protected by
+   the engine.
+ */
+static uint64_t touch_registered = 0;
+static uint64_t touch_performed = 0;
+
+/* Number of consecutive automatic copies performed right away although
+   keeping them pending could have been cheaper. */
+static unsigned int eager_streak = 0;
+
+/* Flag given to the pending copies registered by the current call to
+   delay_memcpy_flags (see DELAY_MEMCPY_DRAIN), and number of pending
+   copies with that flag. Those copies are also linked together,
+   oldest first, so that the drain thread finds them without going
+   through the other pending copies. Protected by the engine.
+ */
+static int new_copies_drained = 0;
+static size_t drained_copies = 0;
+static pending_copy_t *first_drained_copy = NULL;
+static pending_copy_t *last_drained_copy = NULL;
+
+/* Backend used for new pending copies (see delay_memcpy_set_backend). */
+static int backend = DELAY_MEMCPY_BACKEND_SIGSEGV;
+
+/* userfaultfd file descriptor, or -1 if the userfaultfd backend was
+   never started.
+ */
+static int uffd = -1;
+
+/* File descriptor of /proc/self/mem, used to read and write protected
+   pages without changing their protection, and page used to bounce
+   data through it. Opened by open_self_mem.
+ */
+static int mem_fd = -1;
+static void *bounce_page = NULL;
+
+/* Flag to indicate that other threads may run while a copy is
+   performed, so copies must not relax the protection of the pages
+   they involve, even for a moment. Set while the drain thread runs,
+   and for good once a context was created.
+ */
+static int forced_copies = 0;
+static int contexts_created = 0;
+
+/* Context in which copies are registered (see
+   delay_memcpy_create_context). Pending copies registered in a
+   context can be performed together, and the first context created
+   switches the engine to forced copies, so that any thread can use
+   it.
+ */
+struct delay_memcpy_context {
+
+  /* How copies registered in the context are performed (one of the
+     DELAY_MEMCPY_* modes) */
+  int flags;
+};
+
+/* Context given to the pending copies registered by the current call
+   to delay_memcpy_flags, protected by the engine. */
+static delay_memcpy_context_t *new_copies_context = NULL;
+
+/* Run of pages, from page number 'first' to page number 'last'. */
+typedef struct page_range {
+  uintptr_t first;
+  uintptr_t last;
+} page_range_t;
+
+/* Flag set while delay_memcpy_v registers its copies: the pages of
+   new pending copies are left as they are, and added to
+   'deferred_ranges' instead, to be protected all at once when the
+   whole batch is registered. Protected by the engine.
+ */
+static int protection_deferred = 0;
+static page_range_t *deferred_ranges = NULL;
+static size_t deferred_count = 0;
+static size_t deferred_capacity = 0;
+
+/* Part of a pending copy being performed by a fault handler outside
+   of the engine, so that faults on unrelated copies are resolved in
+   parallel (see begin_in_flight_range). Free if size is 0. The pages
+   involved keep their protection until the copy is complete.
+ */
+typedef struct in_flight_range {
+  void *dst;
+  void *src;
+  size_t size;
+} in_flight_range_t;
+
+#define MAX_IN_FLIGHT_RANGES 64
+
+/* Ranges in flight and their number, protected by the engine; the
+   number is also read without it. Any other use of the engine than
+   a fault waits until no range is in flight; the number of threads
+   waiting keeps faults from starting new ones meanwhile.
+ */
+static in_flight_range_t in_flight_ranges[MAX_IN_FLIGHT_RANGES];
+static unsigned int in_flight_count = 0;
+static unsigned int exclusive_waiters = 0;
+
+/* Buffer allocated with delay_memcpy_alloc. Each buffer is a shared
+   mapping of its own memfd, so that its pages can be mapped again at
+   the destination of a copy.
+ */
+typedef struct remap_buffer {
+
+  void *start;
+  size_t size;
+  int fd;
+
+  /* Part of the buffer that was replaced by private mappings of other
+     buffers, as the destination of remapped copies. These pages no
+     longer show the buffer's own file, so they cannot be the source
+     of a remapped copy. Empty if private_start == private_end.
+   */
+  void *private_start;
+  void *private_end;
+
+  struct remap_buffer *next;
+
+} remap_buffer_t;
+
+/* Buffers allocated with delay_memcpy_alloc, protected by the engine. */
+static remap_buffer_t *remap_buffers = NULL;
+
+/* State of the background drain thread (see delay_memcpy_start_drain).
+   Everything but the engine itself is protected by drain_mutex.
+ */
+#define DRAIN_STOPPED 0
+#define DRAIN_RUNNING 1
+#define DRAIN_PAUSED 2
+
+static int drain_state = DRAIN_STOPPED;
+static size_t drain_rate = 0;
+static pthread_t drain_thread;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+
+/* Thread that owns the engine, and number of times it took it. The
+   engine is taken by the signal handler, the userfaultfd handler
+   thread and the public functions. A thread may take it again from
+   the signal handler while it already holds it.
+ */
+static pid_t engine_owner = 0;
+static unsigned int engine_depth = 0;
+
+/* Number of threads asleep until the engine is released, and number
+   of times a thread retries to take the engine before it goes to
+   sleep, rather than yield, so that a thread of lower priority that
+   holds it (the drain thread) gets to run.
+ */
+static unsigned int engine_waiters = 0;
+#define ENGINE_SPIN_COUNT 64
+
+/* Address of the last segmentation fault for which no pending copy
+   was found, and thread that caused it. A fault may find nothing to
+   do if another thread performed the copy, or changed the protection
+   of the page for a moment, while this one was waiting for the
+   engine; the access is then simply retried. Faulting twice in a row
+   on the same address with nothing pending is a genuine segmentation
+   fault.
+ */
+static void *unresolved_fault_addr = NULL;
+static pid_t unresolved_fault_thread = 0;
+
 /* Returns the pointer to the start of the page that contains the
    specified memory address.
  */
@@ -54,45 +562,19 @@ static void *page_start(void *ptr) {
   return (void *) (((intptr_t) ptr) & -page_size);
 }
 
-/* Returns TRUE (non-zero) if the address 'ptr' is in the range of
-   addresses that starts at 'start' and has 'size' bytes (i.e., ends at
-   'start+size-1'). Returns FALSE (zero) otherwise.
- */
-static int address_in_range(void *start, size_t size, void *ptr) {
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  if( ptr >= start && ptr < start+size )
-    {
-      return 1;
-    }
-  else
-    return 0;
-}
-
-/* Returns TRUE (non-zero) if the address 'ptr' is in the same page as
-   any address in the range of addresses that starts at 'start' and
-   has 'size' bytes (i.e., ends at 'start+size-1'). In other words,
-   returns TRUE if the address is in the range [start, start+size-1],
-   or is in the same page as either start or start+size-1. Returns
-   FALSE (zero) otherwise.
+/* Returns the number of the page that contains the specified memory
+   address.
  */
-static int address_in_page_range(void *start, size_t size, void *ptr) {
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  void* page_start_of_range = page_start(start);
-  void* end_of_page_range = page_start(start+size-1) + page_size - 1;
-  
-  if( ptr >= page_start_of_range && ptr <= end_of_page_range )
-    return 1;
-  else
-    return 0;
+static uintptr_t page_number(void *ptr) {
 
+  return ((uintptr_t) ptr) >> page_shift;
 }
 
 /* mprotect requires the start address to be aligned with the page
    size. This function calls mprotect with the start of the page that
    contains ptr, and adjusts the size accordingly to include the extra
-   bytes required for that adjustment.
+   bytes required for that adjustment, up to the end of the last page
+   (mprotect itself would only round it up to a system page).
    
    Obs: according to POSIX documentation, mprotect cannot safely be
    called inside a signal handler. However, in most modern Unix-based
@@ -102,339 +584,4236 @@ static int address_in_page_range(void *start, size_t size, void *ptr) {
 static int mprotect_full_page(void *ptr, size_t size, int prot) {
   
   void *page = page_start(ptr);
-  return mprotect(page, size + (ptr - page), prot);
+  return mprotect(page, page_start(ptr + size - 1) + page_size - page, prot);
 }
 
-/* Changes the permission of the pages to allow them to be copied,
-   then performs the actual copy.
+/* Protects the pages of a new pending copy, like mprotect_full_page,
+   unless the current batch protects them later, in which case they
+   are only recorded (see protection_deferred). They are protected
+   right away if there is no memory to record them.
  */
-static void actual_copy(void *dst, void *src, size_t size) {
-//  printf("\nActual copy. Src: 0x%x  Dst:  0x%x   Size 0x%x\n", src, dst, size);
+static void protect_new_copy(void *ptr, size_t size, int prot) {
 
-  mprotect_full_page(src, size, PROT_READ | PROT_WRITE);
-  mprotect_full_page(dst, size, PROT_READ | PROT_WRITE); 
-  memcpy(dst, src, size);
+  if (protection_deferred) {
+    if (deferred_count == deferred_capacity) {
+      size_t capacity = deferred_capacity ? 2 * deferred_capacity : 64;
+      page_range_t *ranges = realloc(deferred_ranges, capacity * sizeof(*ranges));
+      if (ranges) {
+	deferred_ranges = ranges;
+	deferred_capacity = capacity;
+      }
+    }
+    if (deferred_count < deferred_capacity) {
+      deferred_ranges[deferred_count].first = page_number(ptr);
+      deferred_ranges[deferred_count++].last = page_number(ptr + size - 1);
+      return;
+    }
+  }
+  mprotect_full_page(ptr, size, prot);
+}
 
+/* Sleeps until the 32-bit integer at 'address' is woken up with
+   futex_wake, unless it no longer holds 'value'. Async-signal-safe.
+ */
+static void futex_wait(void *address, unsigned int value) {
 
+  syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
 }
 
+/* Wakes up to 'count' threads asleep on the integer at 'address'.
+   Async-signal-safe.
+ */
+static void futex_wake(void *address, int count) {
 
-/* Adds a pending copy object to the list of pending copies. If
-   base_copy is NULL, adds the object to the end of the list,
-   otherwise adds it right after base_copy.
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Takes the engine for the calling thread, waiting for any other
+   thread that holds it, but not for the ranges in flight. Only the
+   fault handlers and the drain thread use it directly.
+   Async-signal-safe.
  */
-static void add_pending_copy(void *dst, void *src, size_t size, pending_copy_t *base_copy) {
+static void engine_lock_for_fault(void) {
 
-  int i;
+  pid_t self = syscall(SYS_gettid);
+  pid_t owner = 0;
+  unsigned int spins = 0;
 
-  // Find an available copy object slot. This would usually be done
-  // with a call to malloc, but since malloc cannot safely be called
-  // inside a signal handler, this is done with an array of
-  // "pre-allocated" objects.
-  pending_copy_t *new_copy = NULL;
-  for (i = 0; i < MAX_PENDING_COPIES; i++) {
-    if (!pending_copy_slots[i].in_use) {
-      new_copy = &pending_copy_slots[i];
-      break;
-    }
+  if (__atomic_load_n(&engine_owner, __ATOMIC_RELAXED) == self) {
+    engine_depth++;
+    return;
   }
 
-  // If there is no available copy, force the oldest copy object to be copied to make room
-  if (new_copy == NULL) {
-    actual_copy(first_pending_copy->dst, first_pending_copy->src, first_pending_copy->size);
-    new_copy = first_pending_copy;
-    first_pending_copy = new_copy->next;
+  while (!__atomic_compare_exchange_n(&engine_owner, &owner, self, 0,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    if (++spins < ENGINE_SPIN_COUNT)
+      sched_yield();
+    else {
+      __atomic_add_fetch(&engine_waiters, 1, __ATOMIC_SEQ_CST);
+      futex_wait(&engine_owner, owner);
+      __atomic_sub_fetch(&engine_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    owner = 0;
   }
-  
-  if (!base_copy && first_pending_copy)
-    for (base_copy = first_pending_copy; base_copy->next; base_copy = base_copy->next);
+  engine_depth = 1;
+}
 
-  new_copy->src = src;
-  new_copy->dst = dst;
-  new_copy->size = size;
-  new_copy->in_use = 1;
+/* Releases the engine taken with engine_lock or engine_lock_for_fault. */
+static void engine_unlock(void) {
 
-  if (base_copy == new_copy) {
-    // The base copy is the old slot of the current value, so add to start
-    new_copy->next = first_pending_copy;
-    first_pending_copy = new_copy;
-  }
-  if (base_copy) {
-    new_copy->next = base_copy->next;
-    base_copy->next = new_copy;
-  }
-  else {
-    new_copy->next = NULL;
-    first_pending_copy = new_copy;
+  if (--engine_depth == 0) {
+    __atomic_store_n(&engine_owner, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&engine_waiters, __ATOMIC_SEQ_CST))
+      futex_wake(&engine_owner, 1);
   }
 }
 
-/* Removes a pending copy object from the list of pending copies.
+/* Takes the engine for the calling thread, waiting for any other
+   thread that holds it and for every range in flight to complete, so
+   that the caller may change anything. Async-signal-safe.
  */
-static void remove_pending_copy(pending_copy_t *copy) {
+static void engine_lock(void) {
 
-  pending_copy_t *prev = NULL;
+  unsigned int count;
 
-  if (!copy) return;
-  
-  if (copy == first_pending_copy)
-    first_pending_copy = copy->next;
-  else {
+  engine_lock_for_fault();
+  if (engine_depth > 1 || !__atomic_load_n(&in_flight_count, __ATOMIC_ACQUIRE))
+    return;
 
-    for (prev = first_pending_copy; prev && prev->next && prev->next != copy; prev = prev->next);
-    if (prev)
-      prev->next = copy->next;
+  __atomic_add_fetch(&exclusive_waiters, 1, __ATOMIC_SEQ_CST);
+  while ((count = __atomic_load_n(&in_flight_count, __ATOMIC_SEQ_CST))) {
+    engine_unlock();
+    futex_wait(&in_flight_count, count);
+    engine_lock_for_fault();
   }
-
-  copy->in_use = 0;
+  __atomic_sub_fetch(&exclusive_waiters, 1, __ATOMIC_SEQ_CST);
 }
 
-/* Returns the oldest pending copy object for which the source or
-   destination range contains the provided address, either within the
-   range itself, or in the same page in the page table. Returns NULL
-   if no such object exists in the list.
- */
-static pending_copy_t *get_pending_copy(void *ptr) {
-  
-  pending_copy_t *copy;
-  for (copy = first_pending_copy; copy; copy = copy->next) {
-
-    if (address_in_page_range(copy->src, copy->size, ptr) ||
-	address_in_page_range(copy->dst, copy->size, ptr))
-      return copy;
-  }
+/* Returns the object pointed to by the free list link of 'object'. */
+static void **arena_link(slab_arena_t *arena, void *object) {
 
-  return NULL;
+  return (void **) ((char *) object + arena->link_offset);
 }
 
+/* Returns an object to the free list of an arena. Async-signal-safe. */
+static void arena_free(slab_arena_t *arena, void *object) {
 
-static void process_pending_copy( siginfo_t *info, pending_copy_t *copy )
-{
-//  printf("processing_pending_copy copysrc: %x  copydst: %x  size: %x si_addr: %x\n", copy->src, copy->dst, copy->size, info->si_addr);
+  uint64_t head = __atomic_load_n(&arena->free_list, __ATOMIC_ACQUIRE);
+  uint64_t new_head;
 
-  // calculate offset = the offset into the pending copy of the affected address 
-  size_t offset = NULL;
-  if( address_in_range(copy->src, copy->size, info->si_addr) )
-      offset = info->si_addr - copy->src;
-  else
-    offset = info->si_addr - copy->dst;
+  do {
+    *arena_link(arena, object) = (void *) (uintptr_t) (head & ARENA_POINTER_MASK);
+    new_head = (uintptr_t) object | ((head & ~ARENA_POINTER_MASK) + (1ULL << ARENA_TAG_SHIFT));
+  } while (!__atomic_compare_exchange_n(&arena->free_list, &head, new_head, 1,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
 
+  __atomic_add_fetch(&arena->free_count, 1, __ATOMIC_RELAXED);
+}
 
-  // see if the affected address, info->si_addr, is in the first page of the pending copy
-  int is_first_page = 0;
-  if( page_start(copy->src + offset) == page_start(copy->src) )
-    is_first_page = 1;
+/* Takes an object from the free list of an arena. Returns NULL if the
+   free list is empty. Async-signal-safe.
+ */
+static void *arena_alloc(slab_arena_t *arena) {
 
+  uint64_t head = __atomic_load_n(&arena->free_list, __ATOMIC_ACQUIRE);
+  uint64_t new_head;
+  void *object;
 
-  // do the same, but for the last page of the pending copy
-  int is_last_page = 0;
-  if( page_start(copy->src + offset) == page_start(copy->src + copy->size - 1) )
-    is_last_page = 1;
+  do {
+    object = (void *) (uintptr_t) (head & ARENA_POINTER_MASK);
+    if (!object)
+      return NULL;
+    new_head = (uintptr_t) *arena_link(arena, object) | ((head & ~ARENA_POINTER_MASK) + (1ULL << ARENA_TAG_SHIFT));
+  } while (!__atomic_compare_exchange_n(&arena->free_list, &head, new_head, 1,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
 
-  //printf("copy->src: %x\n", copy->src);
-  //printf("offset: %x\n", offset);
+  __atomic_sub_fetch(&arena->free_count, 1, __ATOMIC_RELAXED);
+  return object;
+}
 
-//  if(is_first_page == 1)
-//    printf("is first page!");
+/* Maps a new slab with 'count' objects and adds them to the free list
+   of an arena. Must not be called inside a signal handler. Returns 0
+   on success, or -1 if the memory could not be mapped.
+ */
+static int arena_grow(slab_arena_t *arena, size_t count) {
 
-//  if(is_last_page == 1)
-//    printf("is last page!");
+  char *slab = mmap(NULL, count * arena->object_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slab == MAP_FAILED)
+    return -1;
 
-  // find src and dst of the actual_copy
-  void* actual_copy_src;
-  void* actual_copy_dst;
-  if( is_first_page )
-    {
-      actual_copy_src = copy->src;
-      actual_copy_dst = copy->dst;
-    }
-  else
-    {
-      actual_copy_src = page_start( copy->src + offset );
-      actual_copy_dst = page_start( copy->dst + offset );
-    }
+  arena->capacity += count;
+  while (count--)
+    arena_free(arena, slab + count * arena->object_size);
 
-  // figure out the size of the actual_copy
-  size_t actual_copy_size = 0;
-  if( is_first_page &! is_last_page )
-    {
-      actual_copy_size = page_size - (copy->src - page_start(copy->src));
-    }
-  else if( !is_first_page & is_last_page )
-    {
-      actual_copy_size = copy->src + copy->size - page_start(copy->src + copy->size-1);
-    }
-  else if( !is_first_page & !is_last_page )
-    {
-      actual_copy_size = page_size;
-    }
-  else
-    {
-      actual_copy_size = copy->size;
-    }
+  return 0;
+}
 
-  // now that we know the src, dst, and size of the actual_copy, go ahead and do it
-  actual_copy( actual_copy_dst, actual_copy_src, actual_copy_size );
+/* Returns the hash table bucket for a block of the page index. */
+static page_index_entry_t **page_index_bucket(uintptr_t block, unsigned int level) {
 
+  uint64_t hash = ((uint64_t) block ^ ((uint64_t) level << 58)) * 0x9e3779b97f4a7c15ULL;
+  return &page_index_buckets[hash >> (64 - page_index_bucket_bits)];
+}
 
-  // now to handle splitting and/or deleting of the pending copy
-  if( is_first_page  && !is_last_page )
-    {
-      copy->size -= page_size - (copy->src - page_start(copy->src));
-      copy->src = page_start(copy->src + page_size );
-      copy->dst = page_start(copy->dst + page_size );
-//      printf("new copysrc: %x  new copydst: %x  new size: %x\n", copy->src, copy->dst, copy->size);
-    }
-  else if( !is_first_page && is_last_page )
-    {
-      copy->size -= (copy->src+copy->size - page_start(copy->src + copy->size - 1));
-//      printf("new copysize: %x\n", copy->size);
-    }
-  else if( !is_first_page && !is_last_page )
-    {
+/* Returns the first entry, starting at 'entry' and following the
+   bucket chain, for the specified block. Returns NULL if there is no
+   such entry.
+ */
+static page_index_entry_t *page_index_find(page_index_entry_t *entry, uintptr_t block, unsigned int level) {
 
-      void* new_pending_copy_src = page_start(copy->src + offset) + page_size;
-      void* new_pending_copy_dst = page_start(copy->dst + offset) + page_size;
-      size_t new_pending_copy_size = (copy->src + copy->size) - (page_start(copy->src + offset) + page_size);
-//      printf("Generating new pending copy src: %x  dst: %x  size: %x\n", new_pending_copy_src, new_pending_copy_dst, new_pending_copy_size);
-      add_pending_copy(new_pending_copy_dst, new_pending_copy_src, new_pending_copy_size, copy);
+  while (entry && (entry->block != block || entry->level != level))
+    entry = entry->next;
+  return entry;
+}
 
-      copy->size -= page_size - (copy->src - page_start(copy->src) - page_size);
-//      printf("Shrinking existing copy to: %x\n", copy->size);
-    }
-  else
-    {
-      //printf("Removing pending copy!\n");
-      remove_pending_copy(copy);
-    }
+/* Removes all the page index entries of a pending copy. */
+static void page_index_remove(pending_copy_t *copy) {
 
-}
+  page_index_entry_t *entry, *next;
 
-/* Segmentation fault handler. If the address that caused the
-   segmentation fault (represented by info->si_addr) is part of a
-   pending copy, this function will perform the copy for the entire
-   page that contains the address. If the pending copy corresponding
-   to the address involves more than one page, the object will be
-   replaced with the remaining pages (before and after the affected
-   page), otherwise it will be removed from the list. If the address
-   is not part of a pending copy page, the process will write a
-   message to the standard error (stderr) output and kill the process.
- */
-static void delay_memcpy_segv_handler(int signum, siginfo_t *info, void *context) {
+  for (entry = copy->index_entries; entry; entry = next) {
+    next = entry->next_of_copy;
 
-  pending_copy_t *copy = get_pending_copy(info->si_addr);
-  if (copy == NULL) {
-    write(STDERR_FILENO, "Segmentation fault!\n", 20);
-    raise(SIGKILL);
-  }
+    *entry->pprev = entry->next;
+    if (entry->next)
+      entry->next->pprev = entry->pprev;
 
-  
-  while(copy)
-    {
-      process_pending_copy(info, copy);
-//      printf("Pending copy processed!\n");
-      copy = get_pending_copy(info->si_addr);
-    }
+    *entry->level_pprev = entry->level_next;
+    if (entry->level_next)
+      entry->level_next->level_pprev = entry->level_pprev;
 
+    if (--page_index_level_count[entry->level] == 0)
+      page_index_levels &= ~((uint64_t) 1 << entry->level);
 
+    arena_free(&page_index_arena, entry);
+  }
+  copy->index_entries = NULL;
 }
 
-void reset_pending_copy_slots()
-{
-  first_pending_copy = NULL;
-  for(int i = 0; i < MAX_PENDING_COPIES; i++)
-    {
-      if( pending_copy_slots[i].in_use == 1 )
-	{
-	  
-	  void* src = pending_copy_slots[i].src;
-	  void* dst = pending_copy_slots[i].dst;
-	  size_t size = pending_copy_slots[i].size;
+/* Adds to the page index the pages from 'start' to 'start+size-1',
+   as either the source or the destination of a pending copy. The
+   pages are split into the largest blocks of 2^level pages that are
+   aligned to their own size, so a range of N pages takes at most
+   2*log2(N) entries. Returns 0 on success, or -1 if there are not
+   enough free entries.
+ */
+static int page_index_add_range(pending_copy_t *copy, void *start, size_t size, int is_dst) {
 
-	  void* first_source_page = page_start(src);
-	  void* last_soruce_page = page_start(src+size-1);
+  uintptr_t first = page_number(start);
+  uintptr_t last = page_number(start + size - 1);
 
-	  void* first_dest_page = page_start(dst);
-	  void* last_dest_page = page_start(dst+size-1);
+  while (first <= last) {
 
-	  void* it = first_source_page;
-	  while(it <= last_soruce_page )
-	    {
-	      mprotect_full_page( it, page_size, PROT_READ | PROT_WRITE );
-	      it += page_size;
-	    }
+    unsigned int level = 0;
+    while (level + 1 < PAGE_INDEX_LEVELS &&
+	   !(first & (((uintptr_t) 2 << level) - 1)) &&
+	   last - first >= ((uintptr_t) 2 << level) - 1)
+      level++;
 
+    page_index_entry_t *entry = arena_alloc(&page_index_arena);
+    if (!entry)
+      return -1;
 
-	  it = first_dest_page;
-	  while(it <= last_dest_page )
-	    {
-	      mprotect_full_page( it, page_size, PROT_READ | PROT_WRITE );
-	      it += page_size;
-	    }
+    entry->block = first >> level;
+    entry->level = level;
+    entry->is_dst = is_dst;
+    entry->copy = copy;
 
+    page_index_entry_t **bucket = page_index_bucket(entry->block, level);
+    entry->next = *bucket;
+    entry->pprev = bucket;
+    if (*bucket)
+      (*bucket)->pprev = &entry->next;
+    *bucket = entry;
 
-	  pending_copy_slots[i].in_use = 0;
-	}
-    }
+    page_index_entry_t **level_entries = &page_index_level_entries[level];
+    entry->level_next = *level_entries;
+    entry->level_pprev = level_entries;
+    if (*level_entries)
+      (*level_entries)->level_pprev = &entry->level_next;
+    *level_entries = entry;
 
+    entry->next_of_copy = copy->index_entries;
+    copy->index_entries = entry;
 
-}
+    page_index_level_count[level]++;
+    page_index_levels |= (uint64_t) 1 << level;
+
+    if (last - first < ((uintptr_t) 1 << level))
+      break;
+    first += (uintptr_t) 1 << level;
+  }
+
+  return 0;
+}
+
+/* Adds the source and destination of a pending copy to the page
+   index. Returns 0 on success, or -1 if there are not enough free
+   entries, in which case the copy is left out of the index.
+ */
+static int page_index_add(pending_copy_t *copy) {
+
+  if ((reads_memory(copy->kind) &&
+       page_index_add_range(copy, copy->src, copy->size, 0) < 0) ||
+      page_index_add_range(copy, copy->dst, copy->size, 1) < 0) {
+    page_index_remove(copy);
+    return -1;
+  }
+  return 0;
+}
+
+/* Calls 'visit' for every entry of the page index that involves a
+   page from page number 'first' to page number 'last'. For each level
+   in use, this either probes the hash table for every block of that
+   level in the range, or goes through the list of entries of that
+   level, whichever is shorter. The cost therefore does not depend on
+   the size of the range when few copies are pending, nor on the
+   number of pending copies when the range is small.
+ */
+static void page_index_visit(uintptr_t first, uintptr_t last,
+			     void (*visit)(page_index_entry_t *, void *), void *arg) {
+
+  uint64_t levels;
+
+  for (levels = page_index_levels; levels; levels &= levels - 1) {
+
+    unsigned int level = __builtin_ctzll(levels);
+    uintptr_t first_block = first >> level;
+    uintptr_t last_block = last >> level;
+    page_index_entry_t *entry;
+
+    if (last_block - first_block < page_index_level_count[level]) {
+      uintptr_t block = first_block;
+      do {
+	entry = page_index_find(*page_index_bucket(block, level), block, level);
+	for (; entry; entry = page_index_find(entry->next, block, level))
+	  visit(entry, arg);
+      } while (block++ != last_block);
+    }
+    else {
+      for (entry = page_index_level_entries[level]; entry; entry = entry->level_next)
+	if (entry->block >= first_block && entry->block <= last_block)
+	  visit(entry, arg);
+    }
+  }
+}
+
+/* Search state for find_pending_copy. */
+typedef struct pending_copy_query {
+  int dst_only;
+  pending_copy_t *oldest;
+} pending_copy_query_t;
+
+static void find_pending_copy_visit(page_index_entry_t *entry, void *arg) {
+
+  pending_copy_query_t *query = arg;
+
+  if ((entry->is_dst || !query->dst_only) &&
+      (!query->oldest || entry->copy->seq < query->oldest->seq))
+    query->oldest = entry->copy;
+}
+
+/* Returns the oldest pending copy object for which the destination
+   range, or if 'dst_only' is FALSE (zero) the source range as well,
+   shares a page with the range of addresses that starts at 'start'
+   and has 'size' bytes. Returns NULL if no such object exists in the
+   list.
+ */
+static pending_copy_t *find_pending_copy(void *start, size_t size, int dst_only) {
+
+  pending_copy_query_t query = { dst_only, NULL };
+
+  page_index_visit(page_number(start), page_number(start + size - 1),
+		   find_pending_copy_visit, &query);
+  return query.oldest;
+}
+
+/* Returns the oldest pending copy object for which the source or
+   destination range contains the provided address, either within the
+   range itself, or in the same page in the page table. Returns NULL
+   if no such object exists in the list.
+ */
+static pending_copy_t *get_pending_copy(void *ptr) {
+
+  return find_pending_copy(ptr, 1, 0);
+}
+
+/* Search state for find_pending_destination. */
+typedef struct destination_query {
+  void *start;
+  void *end;
+  int newest;
+  pending_copy_t *found;
+} destination_query_t;
+
+static void find_pending_destination_visit(page_index_entry_t *entry, void *arg) {
+
+  destination_query_t *query = arg;
+  pending_copy_t *copy = entry->copy;
+
+  if (entry->is_dst && copy->dst < query->end && copy->dst + copy->size > query->start &&
+      (!query->found || (query->newest ? copy->seq > query->found->seq : copy->seq < query->found->seq)))
+    query->found = copy;
+}
+
+/* Returns the oldest pending copy object, or the most recent one if
+   'newest' is TRUE (non-zero), whose destination range shares at
+   least a byte (rather than a page) with the range of addresses that
+   starts at 'start' and has 'size' bytes. Returns NULL if no such
+   object exists in the list.
+ */
+static pending_copy_t *find_pending_destination(void *start, size_t size, int newest) {
+
+  destination_query_t query = { start, start + size, newest, NULL };
+
+  page_index_visit(page_number(start), page_number(start + size - 1),
+		   find_pending_destination_visit, &query);
+  return query.found;
+}
+
+/* Search state for refresh_protection: the protection of page 'page',
+   and the first page after it where the protection may change.
+ */
+typedef struct protection_query {
+  uintptr_t page;
+  uintptr_t next;
+  int prot;
+} protection_query_t;
+
+static void refresh_protection_visit(page_index_entry_t *entry, void *arg) {
+
+  protection_query_t *query = arg;
+  uintptr_t first = entry->block << entry->level;
+  uintptr_t end = (entry->block + 1) << entry->level;
+
+  if (first > query->page) {
+    if (first < query->next)
+      query->next = first;
+    return;
+  }
+
+  if (end < query->next)
+    query->next = end;
+  if (!entry->is_dst) {
+    if (query->prot != PROT_NONE)
+      query->prot = PROT_READ;
+  }
+  else if (protects_destination(entry->copy->kind))
+    query->prot = PROT_NONE;
+}
+
+/* Applies the ranges in flight to a protection query, like
+   refresh_protection_visit does for the page index entries: their
+   destination pages stay inaccessible, and their source pages
+   read-only, until they are complete.
+ */
+static void in_flight_protection(protection_query_t *query) {
+
+  unsigned int i;
+
+  for (i = 0; i < MAX_IN_FLIGHT_RANGES; i++) {
+
+    in_flight_range_t *flight = &in_flight_ranges[i];
+    int side;
+
+    if (!flight->size)
+      continue;
+
+    for (side = 0; side < 2; side++) {
+      void *start = side ? flight->src : flight->dst;
+      uintptr_t first = page_number(start);
+      uintptr_t end = page_number(start + flight->size - 1) + 1;
+
+      if (first > query->page) {
+	if (first < query->next)
+	  query->next = first;
+	continue;
+      }
+      if (end <= query->page)
+	continue;
+
+      if (end < query->next)
+	query->next = end;
+      if (!side)
+	query->prot = PROT_NONE;
+      else if (query->prot != PROT_NONE)
+	query->prot = PROT_READ;
+    }
+  }
+}
+
+/* Sets the protection of the pages from 'start' to 'start+size-1'
+   according to the pending copies that remain in the page index, and
+   the ranges in flight: no access for the protected destination of a
+   pending copy, read-only for pages that are only the source of
+   pending copies, and read-write otherwise. Destinations filled through userfaultfd or
+   remapped do not need any protection. The range is walked from one index entry
+   boundary to the next, and consecutive pages with the same
+   protection are changed with a single call to mprotect. Each step
+   only looks for the next boundary within a window twice as long as
+   the previous step, so that a range covered by many small copies is
+   not searched to its end at every step.
+ */
+static void refresh_protection(void *start, size_t size) {
+
+  uintptr_t first = page_number(start);
+  uintptr_t last = page_number(start + size - 1);
+  uintptr_t run = first;
+  int run_prot = -1;
+  uintptr_t page = first;
+  uintptr_t window = 1;
+
+  while (page <= last) {
+
+    uintptr_t limit = last - page < window ? last : page + window - 1;
+    protection_query_t query = { page, limit + 1, PROT_READ | PROT_WRITE };
+    page_index_visit(page, limit, refresh_protection_visit, &query);
+    if (__atomic_load_n(&in_flight_count, __ATOMIC_RELAXED))
+      in_flight_protection(&query);
+
+    if (query.prot != run_prot) {
+      if (run_prot >= 0)
+	mprotect((void *) (run << page_shift), (page - run) << page_shift, run_prot);
+      run = page;
+      run_prot = query.prot;
+    }
+    window = 2 * (query.next - page);
+    page = query.next;
+  }
+  mprotect((void *) (run << page_shift), (last + 1 - run) << page_shift, run_prot);
+}
+
+/* Opens /proc/self/mem and maps the bounce page, if not done yet.
+   Must not be called inside a signal handler. Returns 0 on success,
+   or -1 on failure.
+ */
+static int open_self_mem(void) {
+
+  if (mem_fd >= 0)
+    return 0;
+
+  bounce_page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bounce_page == MAP_FAILED)
+    return -1;
+
+  mem_fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+  if (mem_fd < 0) {
+    munmap(bounce_page, page_size);
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns the buffer allocated with delay_memcpy_alloc that contains
+   the whole range from 'start' to 'start+size-1', or NULL if there is
+   none.
+ */
+static remap_buffer_t *find_remap_buffer(void *start, size_t size) {
+
+  remap_buffer_t *buffer;
+
+  for (buffer = remap_buffers; buffer; buffer = buffer->next)
+    if (start >= buffer->start && start + size <= buffer->start + buffer->size)
+      return buffer;
+  return NULL;
+}
+
+/* Writes 'size' bytes of 'data' to 'dst' through /proc/self/mem, one
+   page at a time. The kernel refuses to write that way to protected
+   pages of a shared mapping: those are written through the memfd of
+   their buffer if they belong to one allocated with
+   delay_memcpy_alloc, and otherwise made writable for the time of the
+   copy, as a last resort. The caller refreshes the protection.
+ */
+static void forced_write(void *dst, void *data, size_t size) {
+
+  while (size > 0) {
+
+    size_t bytes = page_start(dst) + page_size - dst;
+    remap_buffer_t *buffer;
+
+    if (bytes > size)
+      bytes = size;
+
+    if (pwrite(mem_fd, data, bytes, (uintptr_t) dst) != bytes) {
+      buffer = find_remap_buffer(dst, bytes);
+      if (!buffer || pwrite(buffer->fd, data, bytes, dst - buffer->start) != bytes) {
+	mprotect_full_page(dst, bytes, PROT_READ | PROT_WRITE);
+	memcpy(dst, data, bytes);
+      }
+    }
+
+    data += bytes;
+    dst += bytes;
+    size -= bytes;
+  }
+}
+
+/* Copies 'size' bytes from 'src' to 'dst' through /proc/self/mem,
+   which ignores the protection of the pages. The source is handed to
+   the kernel directly when it is readable, and otherwise read through
+   /proc/self/mem as well, one page at a time, into 'bounce'.
+ */
+static void forced_copy_through(void *dst, void *src, size_t size, void *bounce) {
+
+  while (size > 0) {
+
+    ssize_t bytes = pwrite(mem_fd, src, size, (uintptr_t) dst);
+
+    if (bytes <= 0) {
+      bytes = page_start(src) + page_size - src;
+      if (bytes > size)
+	bytes = size;
+      pread(mem_fd, bounce, bytes, (uintptr_t) src);
+      forced_write(dst, bounce, bytes);
+    }
+
+    src += bytes;
+    dst += bytes;
+    size -= bytes;
+  }
+}
+
+/* Same as forced_copy_through, with the bounce page of the engine. */
+static void forced_copy(void *dst, void *src, size_t size) {
+
+  forced_copy_through(dst, src, size, bounce_page);
+}
+
+/* Returns TRUE (non-zero) if the 'size' bytes at 'ptr' are all
+   zeros. Four words are checked per iteration.
+ */
+static int is_zero_generic(void *ptr, size_t size) {
+
+  uint64_t words[4];
+
+  for (; size >= sizeof(words); size -= sizeof(words)) {
+    memcpy(words, ptr, sizeof(words));
+    if (words[0] | words[1] | words[2] | words[3])
+      return 0;
+    ptr += sizeof(words);
+  }
+  for (; size > 0; size--)
+    if (*(unsigned char *) ptr++)
+      return 0;
+  return 1;
+}
+
+#ifdef HAVE_STREAMING_COPY
+
+/* Copy kernels with non-temporal stores. The data goes straight to
+   memory instead of through the cache, so that large copies do not
+   evict the working set of the thread that caused them. 'dst' is
+   aligned to the width of the stores first; the bytes before and
+   after the aligned part are copied with memcpy. Each kernel copies
+   four vectors per iteration and ends with a store fence, so the data
+   is visible to other threads once it returns.
+ */
+#define STREAMING_COPY_KERNEL(name, isa, type, width, load, stream)	\
+  __attribute__((target(isa)))						\
+  static void name(void *dst, void *src, size_t size) {			\
+									\
+    size_t head = -(uintptr_t) dst & (width - 1);			\
+									\
+    if (head > size)							\
+      head = size;							\
+    memcpy(dst, src, head);						\
+    dst += head;							\
+    src += head;							\
+    size -= head;							\
+									\
+    for (; size >= 4 * width; size -= 4 * width) {			\
+      type a = load((type *) src);					\
+      type b = load((type *) (src + width));				\
+      type c = load((type *) (src + 2 * width));			\
+      type d = load((type *) (src + 3 * width));			\
+      stream((type *) dst, a);						\
+      stream((type *) (dst + width), b);				\
+      stream((type *) (dst + 2 * width), c);				\
+      stream((type *) (dst + 3 * width), d);				\
+      src += 4 * width;							\
+      dst += 4 * width;							\
+    }									\
+    _mm_sfence();							\
+									\
+    memcpy(dst, src, size);						\
+  }
+
+STREAMING_COPY_KERNEL(streaming_copy_sse2, "sse2", __m128i, 16,
+		      _mm_loadu_si128, _mm_stream_si128)
+STREAMING_COPY_KERNEL(streaming_copy_avx2, "avx2", __m256i, 32,
+		      _mm256_loadu_si256, _mm256_stream_si256)
+STREAMING_COPY_KERNEL(streaming_copy_avx512, "avx512f", __m512i, 64,
+		      _mm512_loadu_si512, _mm512_stream_si512)
+
+/* Zero tests with vectors. Four vectors are ORed together per
+   iteration, and the result checked, so that a range that is not all
+   zeros is usually told apart at its first bytes. The bytes after the
+   last full iteration are checked with is_zero_generic.
+ */
+#define ZERO_TEST_KERNEL(name, isa, type, width, load, or, zero)	\
+  __attribute__((target(isa)))						\
+  static int name(void *ptr, size_t size) {				\
+									\
+    for (; size >= 4 * width; size -= 4 * width) {			\
+      type a = or(load((type *) ptr), load((type *) (ptr + width)));	\
+      type b = or(load((type *) (ptr + 2 * width)),			\
+		  load((type *) (ptr + 3 * width)));			\
+      if (!zero(or(a, b)))						\
+	return 0;							\
+      ptr += 4 * width;							\
+    }									\
+									\
+    return is_zero_generic(ptr, size);					\
+  }
+
+__attribute__((target("sse2")))
+static int is_zero_sse2_vector(__m128i a) {
+
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static int is_zero_avx2_vector(__m256i a) {
+
+  return _mm256_testz_si256(a, a);
+}
+
+__attribute__((target("avx512f")))
+static int is_zero_avx512_vector(__m512i a) {
+
+  return _mm512_test_epi64_mask(a, a) == 0;
+}
+
+ZERO_TEST_KERNEL(is_zero_sse2, "sse2", __m128i, 16,
+		 _mm_loadu_si128, _mm_or_si128, is_zero_sse2_vector)
+ZERO_TEST_KERNEL(is_zero_avx2, "avx2", __m256i, 32,
+		 _mm256_loadu_si256, _mm256_or_si256, is_zero_avx2_vector)
+ZERO_TEST_KERNEL(is_zero_avx512, "avx512f", __m512i, 64,
+		 _mm512_loadu_si512, _mm512_or_si512, is_zero_avx512_vector)
+
+#endif
+
+/* Selects the widest streaming copy kernel and zero test supported by
+   the CPU. */
+static void select_streaming_copy(void) {
+
+#ifdef HAVE_STREAMING_COPY
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    streaming_copy = streaming_copy_avx512;
+    is_zero = is_zero_avx512;
+  }
+  else if (__builtin_cpu_supports("avx2")) {
+    streaming_copy = streaming_copy_avx2;
+    is_zero = is_zero_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    streaming_copy = streaming_copy_sse2;
+    is_zero = is_zero_sse2;
+  }
+#endif
+}
+
+/* Copies 'size' bytes from 'src' to 'dst', which must both be
+   accessible: with the streaming copy kernel for large copies, and
+   with memcpy otherwise, as the data of smaller ones is usually about
+   to be used.
+ */
+static void copy_bytes(void *dst, void *src, size_t size) {
+
+  if (streaming_copy && size >= streaming_threshold)
+    streaming_copy(dst, src, size);
+  else
+    memcpy(dst, src, size);
+}
+
+/* Returns TRUE (non-zero) if any of the pages from 'start' to
+   'start+size-1', page aligned, is resident in memory.
+ */
+static int has_resident_pages(void *start, size_t size) {
+
+  unsigned char vec[4096];
+
+  while (size > 0) {
+
+    size_t pages = size >> system_page_shift;
+    size_t i;
+
+    if (pages > sizeof(vec))
+      pages = sizeof(vec);
+    if (mincore(start, pages << system_page_shift, vec) < 0)
+      return 1;
+    for (i = 0; i < pages; i++)
+      if (vec[i] & 1)
+	return 1;
+
+    start += pages << system_page_shift;
+    size -= pages << system_page_shift;
+  }
+  return 0;
+}
+
+/* Parses the hexadecimal number at '*text', and moves '*text' past
+   it. */
+static uintptr_t parse_hex(const char **text) {
+
+  uintptr_t value = 0;
+
+  for (;; (*text)++) {
+    char c = **text;
+    if (c >= '0' && c <= '9')
+      value = value * 16 + (c - '0');
+    else if (c >= 'a' && c <= 'f')
+      value = value * 16 + (c - 'a' + 10);
+    else
+      return value;
+  }
+}
+
+/* Returns TRUE (non-zero) if the range from 'start' to
+   'start+size-1' is entirely private anonymous memory, according to
+   /proc/self/maps: a private mapping with no file (inode 0), which
+   dropped pages leave reading as zeros. Pages of any other mapping
+   come back from their file or shared memory instead. Async-signal
+   safe: the file is read with read into a buffer on the stack.
+ */
+static int is_private_anonymous(void *start, size_t size) {
+
+  char buffer[4096];
+  uintptr_t address = (uintptr_t) start;
+  uintptr_t end = address + size;
+  size_t used = 0;
+  ssize_t bytes;
+  int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return 0;
+
+  while (address < end && used < sizeof(buffer) &&
+	 (bytes = read(fd, buffer + used, sizeof(buffer) - used)) > 0) {
+
+    const char *line = buffer;
+    const char *newline;
+
+    used += bytes;
+    while (address < end && (newline = memchr(line, '\n', buffer + used - line))) {
+
+      // start-end perms offset device inode [path]
+      const char *field = line;
+      uintptr_t first = parse_hex(&field);
+      uintptr_t last = (field++, parse_hex(&field));
+      int private = field[4] == 'p';
+      int spaces = 0;
+
+      line = newline + 1;
+      if (last <= address)
+	continue;
+      for (; field < newline && spaces < 4; field++)
+	spaces += *field == ' ';
+      if (first > address || !private || *field != '0' || (field[1] != ' ' && field + 1 != newline)) {
+	close(fd);
+	return 0;
+      }
+      address = last;
+    }
+
+    used = buffer + used - line;
+    memmove(buffer, line, used);
+  }
+
+  close(fd);
+  return address >= end;
+}
+
+/* Drops the system pages from 'start' to 'start+size-1', page
+   aligned, so that they read as zeros again. This only works for
+   private anonymous memory, which the caller checks with
+   is_private_anonymous, and not once userfaultfd is in use, as
+   dropped pages of a range registered with it would be left for its
+   handler thread while the engine may have to write to them. Returns
+   TRUE (non-zero) if the pages were dropped; otherwise their content
+   may have changed, or not.
+ */
+static int drop_zero_pages(void *start, size_t size) {
+
+  return uffd < 0 && !find_remap_buffer(start, size) &&
+    madvise(start, size, MADV_DONTNEED) == 0 && !has_resident_pages(start, size);
+}
+
+/* Copies 'size' bytes from 'src' to 'dst', which must both be
+   accessible, like copy_bytes, except that each run of system pages of
+   the destination whose source is all zeros is dropped instead of
+   copied to, when possible (see drop_zero_pages). Pages that are not
+   all zeros are usually told apart at their first bytes.
+ */
+static void copy_skipping_zero_pages(void *dst, void *src, size_t size) {
+
+  void *first = (void *) (((uintptr_t) dst + system_page_size - 1) & -system_page_size);
+  void *last = (void *) (((uintptr_t) dst + size) & -system_page_size);
+  void *page, *next;
+
+  // only private anonymous pages read as zeros once dropped
+  if (first >= last || uffd >= 0 || !is_private_anonymous(first, last - first)) {
+    copy_bytes(dst, src, size);
+    return;
+  }
+
+  copy_bytes(dst, src, first - dst);
+
+  for (page = first; page < last; page = next) {
+
+    int zero = is_zero(src + (page - dst), system_page_size);
+
+    for (next = page + system_page_size;
+	 next < last && is_zero(src + (next - dst), system_page_size) == zero;
+	 next += system_page_size)
+      ;
+
+    if (zero && drop_zero_pages(page, next - page))
+      STAT_ADD(zero_pages_skipped, (next - page) >> system_page_shift);
+    else
+      copy_bytes(page, src + (page - dst), next - page);
+  }
+
+  copy_bytes(last, src + (last - dst), dst + size - last);
+}
+
+/* Changes the permission of the pages to allow them to be copied,
+   then performs the actual copy. Afterwards the pages get back the
+   protection required by the pending copies that are still in the
+   page index. If other threads may run meanwhile, the copy goes
+   through /proc/self/mem instead, so that they never see a page
+   accessible before it is complete; the source may then be
+   inaccessible, so zero pages are not looked for.
+ */
+static void actual_copy(void *dst, void *src, size_t size) {
+
+  if (forced_copies) {
+    forced_copy(dst, src, size);
+  }
+  else {
+    mprotect_full_page(src, size, PROT_READ | PROT_WRITE);
+    mprotect_full_page(dst, size, PROT_READ | PROT_WRITE); 
+    if (zero_pages)
+      copy_skipping_zero_pages(dst, src, size);
+    else
+      copy_bytes(dst, src, size);
+  }
+
+  refresh_protection(src, size);
+  refresh_protection(dst, size);
+}
+
+#ifdef HAVE_USERFAULTFD
+
+/* Fills the missing, page aligned destination pages of a copy with
+   UFFDIO_COPY, which populates them and wakes any thread waiting for
+   them in a single call. Page aligned sources are passed to the
+   kernel directly. Other sources, and sources that turn out to be
+   protected, are read through /proc/self/mem into a bounce page, so
+   that no protection has to be relaxed while the threads woken up by
+   UFFDIO_COPY run. A page that is somehow present already is copied
+   to through /proc/self/mem instead. When zero pages are looked for
+   (see delay_memcpy_set_zero_pages), every source page is read into
+   the bounce page, and those that are all zeros get the shared zero
+   page with UFFDIO_ZEROPAGE instead.
+ */
+static void actual_copy_missing(void *dst, void *src, size_t size) {
+
+  size_t offset = 0;
+  int aligned = page_start(src) == src;
+  int faulted = 0;
+  int single = 0;
+
+  while (offset < size) {
+
+    struct uffdio_copy copy;
+    int bounce = !aligned || faulted || zero_pages;
+
+    if (bounce)
+      pread(mem_fd, bounce_page, page_size, (uintptr_t) src + offset);
+
+    if (zero_pages && is_zero(bounce_page, page_size)) {
+      struct uffdio_zeropage zero = { { (uintptr_t) dst + offset, page_size }, 0 };
+      if (ioctl(uffd, UFFDIO_ZEROPAGE, &zero) == 0) {
+	STAT_ADD(zero_pages_skipped, page_size >> system_page_shift);
+	offset += page_size;
+	continue;
+      }
+    }
+
+    copy.dst = (uintptr_t) dst + offset;
+    copy.src = bounce ? (uintptr_t) bounce_page : (uintptr_t) src + offset;
+    copy.len = bounce || single ? page_size : size - offset;
+    copy.mode = 0;
+    copy.copy = 0;
+    faulted = 0;
+
+    if (ioctl(uffd, UFFDIO_COPY, &copy) == 0) {
+      offset += copy.len;
+    }
+    else if (copy.copy > 0) {
+      offset += copy.copy;
+    }
+    else if (errno == EFAULT && !bounce) {
+      faulted = 1;
+    }
+    else if (errno == ENOENT && copy.len > page_size) {
+      // the range spans several VMAs, which UFFDIO_COPY does not handle
+      single = 1;
+    }
+    else if (errno == EEXIST) {
+      forced_copy(dst + offset, src + offset, page_size);
+      offset += page_size;
+    }
+    else if (errno != EAGAIN) {
+      write(STDERR_FILENO, "UFFDIO_COPY failed!\n", 20);
+      raise(SIGKILL);
+    }
+  }
+
+  refresh_protection(src, size);
+}
+
+/* Fills the missing, page aligned destination pages of a dropped copy
+   with zeros, as they would otherwise fault forever, and the engine
+   itself may have to write to them. Pages that are somehow present
+   already are left alone.
+ */
+static void zero_missing(void *dst, size_t size) {
+
+  size_t offset;
+
+  for (offset = 0; offset < size; offset += page_size) {
+    struct uffdio_zeropage zero = { { (uintptr_t) dst + offset, page_size }, 0 };
+    if (ioctl(uffd, UFFDIO_ZEROPAGE, &zero) < 0 && errno == EEXIST)
+      ioctl(uffd, UFFDIO_WAKE, &zero.range);
+  }
+}
+
+#else
+
+static void actual_copy_missing(void *dst, void *src, size_t size) {
+
+  actual_copy(dst, src, size);
+}
+
+static void zero_missing(void *dst, size_t size) {
+}
+
+#endif
+
+/* Gives the page aligned destination pages of a remapped copy their
+   own copy of the data, by writing to them: the kernel duplicates
+   each page that still shares the source's memory, and leaves alone
+   the ones that were written since. MADV_POPULATE_WRITE does this
+   for the whole range at once; if it is not available, or some pages
+   are protected by a newer copy, each system page is written through
+   /proc/self/mem with the value it already holds.
+ */
+static void actual_copy_remapped(void *dst, void *src, size_t size) {
+
+  size_t offset;
+  char byte;
+
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(dst, size, MADV_POPULATE_WRITE) == 0) {
+    refresh_protection(src, size);
+    return;
+  }
+#endif
+
+  for (offset = 0; offset < size; offset += system_page_size) {
+    pread(mem_fd, &byte, 1, (uintptr_t) dst + offset);
+    pwrite(mem_fd, &byte, 1, (uintptr_t) dst + offset);
+  }
+
+  refresh_protection(src, size);
+}
+
+/* Reads 'size' bytes at 'offset' in file 'fd' to 'dst', which must be
+   writable unless copies are forced, in which case the bytes go
+   through the bounce page and /proc/self/mem one page at a time.
+   Bytes past the end of the file, or that cannot be read, are zeros,
+   as there is nobody to report the error to.
+ */
+static void read_file_range(void *dst, int fd, off_t offset, size_t size) {
+
+  while (size > 0) {
+
+    size_t bytes = size;
+    void *buffer = dst;
+    ssize_t done;
+
+    if (forced_copies) {
+      bytes = page_start(dst) + page_size - dst;
+      if (bytes > size)
+	bytes = size;
+      buffer = bounce_page;
+    }
+
+    done = pread(fd, buffer, bytes, offset);
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done <= 0) {
+      memset(buffer, 0, bytes);
+      done = bytes;
+    }
+    if (forced_copies)
+      forced_write(dst, buffer, done);
+
+    dst += done;
+    offset += done;
+    size -= done;
+  }
+}
+
+/* Fills the destination of a file copy with the 'size' bytes at
+   'offset' in file 'fd', read into the memory already there. The
+   destination is never replaced by a mapping of the file: its pages
+   would keep following the file until written, fault once it is
+   truncated, and stop being shared with other mappings of the
+   destination.
+ */
+static void actual_read_file(void *dst, int fd, off_t offset, size_t size) {
+
+  if (!forced_copies)
+    mprotect_full_page(dst, size, PROT_READ | PROT_WRITE);
+  read_file_range(dst, fd, offset, size);
+
+  refresh_protection(dst, size);
+}
+
+/* Fills 'size' bytes at 'dst' with byte 'c', through the bounce page
+   and /proc/self/mem if copies are forced.
+ */
+static void actual_fill(void *dst, int c, size_t size) {
+
+  size_t offset, bytes;
+
+  if (forced_copies) {
+    memset(bounce_page, c, page_size);
+    for (offset = 0; offset < size; offset += bytes) {
+      bytes = page_start(dst + offset) + page_size - (dst + offset);
+      if (bytes > size - offset)
+	bytes = size - offset;
+      forced_write(dst + offset, bounce_page, bytes);
+    }
+  }
+  else {
+    mprotect_full_page(dst, size, PROT_READ | PROT_WRITE);
+    memset(dst, c, size);
+  }
+
+  refresh_protection(dst, size);
+}
+
+/* Moves all the entries of the page index to a hash table with
+   2^bits buckets. Must not be called inside a signal handler. Returns
+   0 on success, or -1 if the new table could not be mapped.
+ */
+static int page_index_resize(unsigned int bits) {
+
+  size_t old_size = page_index_buckets ? sizeof(*page_index_buckets) << page_index_bucket_bits : 0;
+  page_index_entry_t **old_buckets = page_index_buckets;
+  page_index_entry_t **buckets;
+  pending_copy_t *copy;
+  page_index_entry_t *entry;
+
+  buckets = mmap(NULL, sizeof(*buckets) << bits, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buckets == MAP_FAILED)
+    return -1;
+
+  page_index_buckets = buckets;
+  page_index_bucket_bits = bits;
+
+  for (copy = first_pending_copy; copy; copy = copy->next)
+    for (entry = copy->index_entries; entry; entry = entry->next_of_copy) {
+      page_index_entry_t **bucket = page_index_bucket(entry->block, entry->level);
+      entry->next = *bucket;
+      entry->pprev = bucket;
+      if (*bucket)
+	(*bucket)->pprev = &entry->next;
+      *bucket = entry;
+    }
+
+  if (old_buckets)
+    munmap(old_buckets, old_size);
+  return 0;
+}
+
+/* Grows the arenas and the page index, if needed, so that the signal
+   handler finds enough free objects to split pending copies, and
+   registering new copies does not have to force older ones. Must not
+   be called inside a signal handler.
+ */
+static void reserve_pending_copies(void) {
+
+  size_t capacity = pending_copy_arena.capacity;
+  size_t entries;
+
+  if (pending_copy_arena.free_count < PENDING_COPY_SLACK &&
+      capacity < max_pending_copies + PENDING_COPY_SLACK)
+    arena_grow(&pending_copy_arena, capacity > PENDING_COPY_SLACK ? capacity : PENDING_COPY_SLACK);
+
+  capacity = page_index_arena.capacity;
+  if (page_index_arena.free_count < PENDING_COPY_SLACK * PAGE_INDEX_ENTRIES_PER_COPY)
+    arena_grow(&page_index_arena, capacity > PENDING_COPY_SLACK * PAGE_INDEX_ENTRIES_PER_COPY ?
+	       capacity : PENDING_COPY_SLACK * PAGE_INDEX_ENTRIES_PER_COPY);
+
+  entries = page_index_arena.capacity - page_index_arena.free_count;
+  if (entries > (2UL << page_index_bucket_bits))
+    page_index_resize(page_index_bucket_bits + 1);
+}
+
+/* Updates the current and peak number of pending copies. */
+static void update_pending_stats(void) {
+
+  unsigned long peak = __atomic_load_n(&stats.peak_pending_copies, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&stats.pending_copies, pending_copies_in_use, __ATOMIC_RELAXED);
+  while (pending_copies_in_use > peak &&
+	 !__atomic_compare_exchange_n(&stats.peak_pending_copies, &peak, pending_copies_in_use,
+				      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Returns a free pending copy object, or NULL if the maximum number of
+   pending copies is reached or there is no free object left. This
+   would usually be done with a call to malloc, but since malloc
+   cannot safely be called inside a signal handler, objects are taken
+   from an arena that is only grown outside of the handler.
+ */
+static pending_copy_t *allocate_pending_copy(void) {
+
+  pending_copy_t *copy;
+
+  if (pending_copies_in_use >= max_pending_copies)
+    return NULL;
+
+  copy = arena_alloc(&pending_copy_arena);
+  if (copy) {
+    copy->in_use = 1;
+    copy->drain = 0;
+    copy->index_entries = NULL;
+    copy->fanout_next = copy;
+    copy->fanout_prev = copy;
+    pending_copies_in_use++;
+    update_pending_stats();
+  }
+  return copy;
+}
+
+/* Inserts a pending copy object in the list of pending copies. If
+   base_copy is NULL, adds the object to the end of the list,
+   otherwise adds it right after base_copy.
+ */
+static void insert_pending_copy(pending_copy_t *copy, pending_copy_t *base_copy) {
+
+  if (!base_copy)
+    base_copy = last_pending_copy;
+
+  copy->prev = base_copy;
+  if (base_copy) {
+    copy->next = base_copy->next;
+    base_copy->next = copy;
+  }
+  else {
+    copy->next = NULL;
+    first_pending_copy = copy;
+  }
+  if (copy->next)
+    copy->next->prev = copy;
+  else
+    last_pending_copy = copy;
+}
+
+/* Takes a pending copy out of its fan-out ring, if any. */
+static void fanout_unlink(pending_copy_t *copy) {
+
+  copy->fanout_prev->fanout_next = copy->fanout_next;
+  copy->fanout_next->fanout_prev = copy->fanout_prev;
+  copy->fanout_next = copy;
+  copy->fanout_prev = copy;
+}
+
+/* Adds pending copy 'copy', which must be outside of any ring and
+   requested after every copy of the ring of 'newest', to that ring,
+   right after 'newest'.
+ */
+static void fanout_link(pending_copy_t *copy, pending_copy_t *newest) {
+
+  copy->fanout_prev = newest;
+  copy->fanout_next = newest->fanout_next;
+  newest->fanout_next->fanout_prev = copy;
+  newest->fanout_next = copy;
+}
+
+/* Flags a pending copy, already in the list of pending copies, to be
+   drained, and adds it to the list of drained copies at the same
+   place. A copy at the end of the list goes to the end; any other,
+   typically the tail of a split copy, right after the previous
+   drained copy.
+ */
+static void drain_link(pending_copy_t *copy) {
+
+  pending_copy_t *prev;
+
+  if (!copy->next)
+    prev = last_drained_copy;
+  else
+    for (prev = copy->prev; prev && !prev->drain; prev = prev->prev);
+
+  copy->drain = 1;
+  copy->drain_prev = prev;
+  copy->drain_next = prev ? prev->drain_next : first_drained_copy;
+  if (prev)
+    prev->drain_next = copy;
+  else
+    first_drained_copy = copy;
+  if (copy->drain_next)
+    copy->drain_next->drain_prev = copy;
+  else
+    last_drained_copy = copy;
+  drained_copies++;
+}
+
+/* Takes a pending copy out of the list of drained copies, if it is in
+   it. */
+static void drain_unlink(pending_copy_t *copy) {
+
+  if (!copy->drain)
+    return;
+
+  if (copy->drain_prev)
+    copy->drain_prev->drain_next = copy->drain_next;
+  else
+    first_drained_copy = copy->drain_next;
+  if (copy->drain_next)
+    copy->drain_next->drain_prev = copy->drain_prev;
+  else
+    last_drained_copy = copy->drain_prev;
+  copy->drain = 0;
+  drained_copies--;
+}
+
+/* Removes a pending copy object from the list of pending copies, from
+   its fan-out ring and from the page index.
+ */
+static void remove_pending_copy(pending_copy_t *copy) {
+
+  if (!copy) return;
+  
+  if (copy->prev)
+    copy->prev->next = copy->next;
+  else
+    first_pending_copy = copy->next;
+  if (copy->next)
+    copy->next->prev = copy->prev;
+  else
+    last_pending_copy = copy->prev;
+
+  fanout_unlink(copy);
+  page_index_remove(copy);
+  drain_unlink(copy);
+  copy->in_use = 0;
+  pending_copies_in_use--;
+  update_pending_stats();
+  arena_free(&pending_copy_arena, copy);
+}
+
+static void process_pending_range(pending_copy_t *copy, void *start, size_t size, int dst_only);
+
+/* Performs every pending copy older than sequence number 'seq' that
+   involves a page in the range from 'start' to 'start+size-1', as far
+   as those pages are concerned. Returns TRUE (non-zero) if there was
+   any.
+ */
+static int resolve_older_copies(void *start, size_t size, unsigned long seq) {
+
+  pending_copy_t *copy;
+  int resolved = 0;
+
+  while ((copy = find_pending_copy(start, size, 0)) && copy->seq < seq) {
+    process_pending_range(copy, start, size, 0);
+    resolved = 1;
+  }
+  return resolved;
+}
+
+/* Takes the '*size' bytes that start '*offset' bytes into a pending
+   copy out of it. Bytes before and after that part remain pending,
+   splitting the object in two if needed. If there is no room left to
+   keep them pending, they are taken out as well, and '*offset' and
+   '*size' are updated to cover them. The object leaves its fan-out
+   ring, and may be released, so the caller must read anything it
+   needs from it beforehand. Returns the object that keeps the bytes
+   after that part pending, or NULL if there is none.
+ */
+static pending_copy_t *detach_pending_range(pending_copy_t *copy, size_t *offset_ptr, size_t *size_ptr) {
+
+  int kind = copy->kind;
+  void *src = copy->src;
+  void *dst = copy->dst;
+  unsigned long seq = copy->seq;
+  size_t offset = *offset_ptr;
+  size_t size = *size_ptr;
+  size_t head = offset;
+  size_t tail = copy->size - offset - size;
+  pending_copy_t *tail_copy = NULL;
+
+  fanout_unlink(copy);
+  page_index_remove(copy);
+
+  if (tail) {
+    tail_copy = head ? allocate_pending_copy() : copy;
+    if (tail_copy) {
+      tail_copy->src = src + offset + size;
+      tail_copy->dst = dst + offset + size;
+      tail_copy->size = tail;
+      tail_copy->seq = seq;
+      tail_copy->kind = kind;
+      tail_copy->context = copy->context;
+      tail_copy->operand = copy->operand;
+      tail_copy->fault_window = copy->fault_window;
+      tail_copy->next_fault_page = copy->next_fault_page;
+      if (tail_copy != copy) {
+	insert_pending_copy(tail_copy, copy);
+	if (copy->drain)
+	  drain_link(tail_copy);
+      }
+      if (page_index_add(tail_copy) < 0) {
+	if (tail_copy != copy)
+	  remove_pending_copy(tail_copy);
+	tail_copy = NULL;
+      }
+      else if (tail_copy != copy)
+	STAT_ADD(splits, 1);
+    }
+    if (!tail_copy)
+      size += tail;
+  }
+
+  if (head) {
+    copy->size = head;
+    if (page_index_add(copy) < 0) {
+      offset = 0;
+      size += head;
+      head = 0;
+    }
+  }
+
+  if (!head && copy != tail_copy)
+    remove_pending_copy(copy);
+
+  *offset_ptr = offset;
+  *size_ptr = size;
+  return tail_copy;
+}
+
+/* Performs a part, already detached from its pending copy object, of
+   a copy of kind 'kind', sequence number 'seq' and operand 'operand'
+   (see pending_copy_t). Any older pending copy sharing a page with the
+   copied bytes is performed first, so copies with overlapping regions
+   still take effect in the order of the list.
+ */
+static void perform_detached_range(int kind, void *dst, void *src, size_t size, unsigned long seq,
+				   int operand) {
+
+  if (reads_memory(kind))
+    resolve_older_copies(src, size, seq);
+  resolve_older_copies(dst, size, seq);
+  STAT_ADD(bytes_copied, size);
+  touch_performed += size;
+  if (kind == PENDING_COPY_MISSING)
+    actual_copy_missing(dst, src, size);
+  else if (kind == PENDING_COPY_REMAPPED)
+    actual_copy_remapped(dst, src, size);
+  else if (kind == PENDING_COPY_FILE)
+    actual_read_file(dst, operand, (uintptr_t) src, size);
+  else if (kind == PENDING_COPY_FILL)
+    actual_fill(dst, operand, size);
+  else
+    actual_copy(dst, src, size);
+}
+
+/* Performs the 'size' bytes of a pending copy that start 'offset'
+   bytes into it. Bytes before and after that part remain pending,
+   splitting the object in two if needed. If there is no room left to
+   keep them pending they are copied as well.
+ */
+static void materialize_pending_copy(pending_copy_t *copy, size_t offset, size_t size) {
+
+  // Missing or remapped destination pages can only be filled as a whole
+  if (copy->kind == PENDING_COPY_MISSING || copy->kind == PENDING_COPY_REMAPPED) {
+    size += offset - (offset & -page_size);
+    offset &= -page_size;
+    size = (size + page_size - 1) & -page_size;
+  }
+
+  int kind = copy->kind;
+  void *src = copy->src;
+  void *dst = copy->dst;
+  unsigned long seq = copy->seq;
+  int operand = copy->operand;
+
+  detach_pending_range(copy, &offset, &size);
+  perform_detached_range(kind, dst + offset, src + offset, size, seq, operand);
+}
+
+/* Drops the 'size' bytes of a pending copy that start 'offset' bytes
+   into it, without performing them, and gives their pages the
+   protection required by the remaining pending copies. Bytes before
+   and after that part remain pending; if there is no room left to
+   keep them pending they are copied. For missing or remapped
+   destinations, the part must cover whole pages.
+ */
+static void discard_pending_range(pending_copy_t *copy, size_t offset, size_t size) {
+
+  int kind = copy->kind;
+  void *src = copy->src;
+  void *dst = copy->dst;
+  unsigned long seq = copy->seq;
+  int operand = copy->operand;
+  size_t first = offset;
+  size_t detached = size;
+
+  detach_pending_range(copy, &first, &detached);
+
+  if (first < offset)
+    perform_detached_range(kind, dst + first, src + first, offset - first, seq, operand);
+  if (first + detached > offset + size)
+    perform_detached_range(kind, dst + offset + size, src + offset + size,
+			   first + detached - (offset + size), seq, operand);
+
+  STAT_ADD(bytes_never_copied, size);
+  if (kind == PENDING_COPY_MISSING)
+    zero_missing(dst + offset, size);
+  if (reads_memory(kind))
+    refresh_protection(src + offset, size);
+  refresh_protection(dst + offset, size);
+}
+
+/* Performs, in the order of the list, every pending copy whose
+   destination shares a page with the range from 'start' to
+   'start+size-1', as far as those pages are concerned.
+ */
+static void resolve_pending_destinations(void *start, size_t size) {
+
+  pending_copy_t *copy;
+
+  while ((copy = find_pending_copy(start, size, 1)))
+    process_pending_range(copy, start, size, 1);
+}
+
+/* Performs a copy right away, after any pending copy involving the
+   same pages.
+ */
+static void copy_now(void *dst, void *src, size_t size) {
+
+  resolve_older_copies(src, size, last_copy_seq + 1);
+  resolve_older_copies(dst, size, last_copy_seq + 1);
+  actual_copy(dst, src, size);
+}
+
+/* Adds a pending copy object to the list of pending copies. If
+   base_copy is NULL, adds the object to the end of the list,
+   otherwise adds it right after base_copy. 'kind' tells how the
+   destination is handled (see PENDING_COPY_PROTECTED). If there is no available
+   object, or no room in the page index, the oldest copies are
+   performed to make room, so base_copy must not be at the start of
+   the list. Returns the new object, or NULL if the copy could not be
+   kept pending at all.
+ */
+static pending_copy_t *add_pending_copy(void *dst, void *src, size_t size, pending_copy_t *base_copy, int kind) {
+
+  pending_copy_t *new_copy = allocate_pending_copy();
+
+  // If there is no available copy, force the oldest copy object to be copied to make room
+  while (new_copy == NULL) {
+    if (!first_pending_copy)
+      return NULL;
+    STAT_ADD(forced_evictions, 1);
+    materialize_pending_copy(first_pending_copy, 0, first_pending_copy->size);
+    new_copy = allocate_pending_copy();
+  }
+  
+  new_copy->src = src;
+  new_copy->dst = dst;
+  new_copy->size = size;
+  new_copy->kind = kind;
+  new_copy->context = new_copies_context;
+  new_copy->operand = -1;
+  new_copy->fault_window = 0;
+  new_copy->seq = base_copy ? base_copy->seq : ++last_copy_seq;
+  if (!base_copy) {
+    STAT_ADD(copies_registered, 1);
+    STAT_ADD(bytes_registered, size);
+    touch_registered += size;
+    if (touch_registered > 2 * TOUCH_RATIO_WINDOW) {
+      touch_registered /= 2;
+      touch_performed /= 2;
+    }
+  }
+  insert_pending_copy(new_copy, base_copy);
+  if (new_copies_drained)
+    drain_link(new_copy);
+
+  while (page_index_add(new_copy) < 0) {
+    if (first_pending_copy == new_copy) {
+      remove_pending_copy(new_copy);
+      return NULL;
+    }
+    STAT_ADD(forced_evictions, 1);
+    materialize_pending_copy(first_pending_copy, 0, first_pending_copy->size);
+  }
+
+  return new_copy;
+}
+
+/* Sets '*first' and '*last' to the offsets into a pending copy of the
+   bytes process_pending_range performs for the range from 'start' to
+   'start+size-1'.
+ */
+static void pending_range_bounds(pending_copy_t *copy, void *start, size_t size, int dst_only,
+				 size_t *first_ptr, size_t *last_ptr)
+{
+  void *first_page = page_start(start);
+  void *end = page_start(start + size - 1) + page_size;
+  size_t first = copy->size;
+  size_t last = 0;
+
+  // offsets into the pending copy of the bytes whose destination is in the pages
+  if (copy->dst < end && copy->dst + copy->size > first_page) {
+    first = first_page > copy->dst ? first_page - copy->dst : 0;
+    last = end - copy->dst;
+  }
+
+  // same, for the bytes whose source is in the pages
+  if (!dst_only && reads_memory(copy->kind) && copy->src < end && copy->src + copy->size > first_page) {
+    size_t src_first = first_page > copy->src ? first_page - copy->src : 0;
+    size_t src_last = end - copy->src;
+    if (src_first < first)
+      first = src_first;
+    if (src_last > last)
+      last = src_last;
+  }
+
+  if (last > copy->size)
+    last = copy->size;
+
+  *first_ptr = first;
+  *last_ptr = last;
+}
+
+/* Performs the part of a pending copy that involves the pages from
+   'start' to 'start+size-1': the bytes whose destination is in those
+   pages, and unless 'dst_only' is TRUE (non-zero) the bytes whose
+   source is in those pages, as well as anything in between. The rest
+   of the copy remains pending.
+ */
+static void process_pending_range(pending_copy_t *copy, void *start, size_t size, int dst_only)
+{
+  size_t first, last;
+
+  pending_range_bounds(copy, start, size, dst_only, &first, &last);
+  materialize_pending_copy(copy, first, last - first);
+}
+
+/* Returns TRUE (non-zero) if the pages of the ranges from 'a' to
+   'a+a_size-1' and from 'b' to 'b+b_size-1' overlap.
+ */
+static int pages_overlap(void *a, size_t a_size, void *b, size_t b_size) {
+
+  return page_start(a) < page_start(b + b_size - 1) + page_size &&
+    page_start(b) < page_start(a + a_size - 1) + page_size;
+}
+
+/* Search state for shares_pages: the copy to ignore, whether entries
+   for sources count, and the result. */
+typedef struct shared_pages_query {
+  pending_copy_t *copy;
+  int sources;
+  int found;
+} shared_pages_query_t;
+
+static void shares_pages_visit(page_index_entry_t *entry, void *arg) {
+
+  shared_pages_query_t *query = arg;
+
+  if (entry->copy != query->copy && (entry->is_dst || query->sources))
+    query->found = 1;
+}
+
+/* Returns TRUE (non-zero) if a pending copy other than 'copy', or a
+   range in flight, may read or write the destination pages of the
+   range of 'size' bytes from 'src' to 'dst', or write its source
+   pages.
+ */
+static int shares_pages(pending_copy_t *copy, void *dst, void *src, size_t size) {
+
+  shared_pages_query_t query = { copy, 1, 0 };
+  unsigned int i;
+
+  for (i = 0; i < MAX_IN_FLIGHT_RANGES; i++) {
+    in_flight_range_t *flight = &in_flight_ranges[i];
+    if (flight->size &&
+	(pages_overlap(flight->dst, flight->size, dst, size) ||
+	 pages_overlap(flight->dst, flight->size, src, size) ||
+	 pages_overlap(flight->src, flight->size, dst, size)))
+      return 1;
+  }
+
+  page_index_visit(page_number(dst), page_number(dst + size - 1), shares_pages_visit, &query);
+  query.sources = 0;
+  page_index_visit(page_number(src), page_number(src + size - 1), shares_pages_visit, &query);
+  return query.found;
+}
+
+/* Takes the 'size' bytes that start 'offset' bytes into a pending
+   copy out of it, to be performed by the calling fault handler
+   outside of the engine, in parallel with other faults. This is only
+   done when copies are forced anyway, the caller took the engine
+   once, nobody waits for the engine to be free of ranges in flight,
+   and no other pending copy or range in flight involves the pages in
+   a way that orders it with the range, so that the range can be
+   performed on its own. Sets '*flight' to the range in flight.
+   Returns TRUE (non-zero) if the bytes were taken out of the copy:
+   if there was no room to keep the rest of the copy pending, it is
+   all performed right away instead, and '*flight' is NULL.
+ */
+static int begin_in_flight_range(pending_copy_t *copy, size_t offset, size_t size,
+				 in_flight_range_t **flight_ptr) {
+
+  in_flight_range_t *flight = NULL;
+  void *src = copy->src;
+  void *dst = copy->dst;
+  unsigned long seq = copy->seq;
+  size_t first = offset;
+  size_t detached = size;
+  unsigned int i;
+
+  *flight_ptr = NULL;
+  if (!forced_copies || mem_fd < 0 || engine_depth != 1 || copy->kind != PENDING_COPY_PROTECTED ||
+      __atomic_load_n(&exclusive_waiters, __ATOMIC_RELAXED))
+    return 0;
+
+  for (i = 0; i < MAX_IN_FLIGHT_RANGES && !flight; i++)
+    if (!in_flight_ranges[i].size)
+      flight = &in_flight_ranges[i];
+  if (!flight || pages_overlap(dst, copy->size, src + offset, size) ||
+      shares_pages(copy, dst + offset, src + offset, size))
+    return 0;
+
+  detach_pending_range(copy, &first, &detached);
+  if (first != offset || detached != size) {
+    perform_detached_range(PENDING_COPY_PROTECTED, dst + first, src + first, detached, seq, -1);
+    return 1;
+  }
+
+  STAT_ADD(bytes_copied, size);
+  touch_performed += size;
+  flight->dst = dst + offset;
+  flight->src = src + offset;
+  flight->size = size;
+  __atomic_add_fetch(&in_flight_count, 1, __ATOMIC_RELEASE);
+  *flight_ptr = flight;
+  return 1;
+}
+
+/* Performs a range in flight. Called without the engine. */
+static void perform_in_flight_range(in_flight_range_t *flight) {
+
+  ssize_t bytes = pwrite(mem_fd, flight->src, flight->size, (uintptr_t) flight->dst);
+
+  if (bytes < 0)
+    bytes = 0;
+  forced_write(flight->dst + bytes, flight->src + bytes, flight->size - bytes);
+}
+
+/* Releases a range in flight once performed, and gives its pages the
+   protection required by what remains. Called with the engine.
+ */
+static void end_in_flight_range(in_flight_range_t *flight) {
+
+  void *dst = flight->dst;
+  void *src = flight->src;
+  size_t size = flight->size;
+
+  flight->size = 0;
+  __atomic_sub_fetch(&in_flight_count, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&exclusive_waiters, __ATOMIC_SEQ_CST))
+    futex_wake(&in_flight_count, INT32_MAX);
+  refresh_protection(src, size);
+  refresh_protection(dst, size);
+}
+
+/* Returns TRUE (non-zero) if the page containing 'ptr' is involved in
+   a range in flight.
+ */
+static int in_flight_page(void *ptr) {
+
+  unsigned int i;
+
+  for (i = 0; i < MAX_IN_FLIGHT_RANGES; i++) {
+    in_flight_range_t *flight = &in_flight_ranges[i];
+    if (flight->size &&
+	(pages_overlap(flight->dst, flight->size, ptr, 1) ||
+	 pages_overlap(flight->src, flight->size, ptr, 1)))
+      return 1;
+  }
+  return 0;
+}
+
+/* Makes pending copy 'copy' the newest of the fan-out ring whose
+   newest copy is '*newest', if that copy is still pending with the
+   same source and size, and otherwise the start of a ring of its own.
+ */
+static void fanout_append(pending_copy_t **newest, pending_copy_t *copy) {
+
+  pending_copy_t *last = *newest;
+
+  if (last && last != copy && last->in_use && last->kind == PENDING_COPY_PROTECTED &&
+      last->src == copy->src && last->size == copy->size)
+    fanout_link(copy, last);
+  *newest = copy;
+}
+
+/* Performs, for every copy of the fan-out ring of 'copy', oldest
+   first, the bytes whose source is in the pages from 'start' to
+   'start+size-1', in a single pass: the source pages are made
+   accessible once, and get their protection back once every
+   destination is written, rather than once per copy. The parts of
+   the copies before those bytes form a new ring, and so do the parts
+   after them. Returns the number of bytes performed.
+ */
+static size_t perform_fanout(pending_copy_t *copy, void *start, size_t size) {
+
+  void *first_page = page_start(start);
+  void *end = page_start(start + size - 1) + page_size;
+  void *src = copy->src;
+  size_t copy_size = copy->size;
+  size_t first = first_page > src ? first_page - src : 0;
+  size_t last = end - src < copy_size ? end - src : copy_size;
+  pending_copy_t *heads = NULL, *tails = NULL;
+  pending_copy_t *member, *next, *newest, *tail;
+  size_t performed = 0;
+  int exposed = 0;
+
+  while (copy->fanout_prev->seq < copy->seq)
+    copy = copy->fanout_prev;
+  newest = copy->fanout_prev;
+
+  for (member = copy; member; member = next) {
+
+    void *dst = member->dst;
+    unsigned long seq = member->seq;
+    size_t offset = first;
+    size_t bytes = last - first;
+
+    // performing a copy only performs older ones first, so the next one stays in the ring
+    next = member == newest ? NULL : member->fanout_next;
+
+    tail = detach_pending_range(member, &offset, &bytes);
+    if (offset > 0)
+      fanout_append(&heads, member);
+    if (tail)
+      fanout_append(&tails, tail);
+    performed += bytes;
+
+    if (offset != first || bytes != last - first) {
+      // there was no room to keep the rest pending
+      perform_detached_range(PENDING_COPY_PROTECTED, dst + offset, src + offset, bytes, seq, -1);
+      exposed = 0;
+      continue;
+    }
+
+    if (resolve_older_copies(src + first, bytes, seq) | resolve_older_copies(dst + first, bytes, seq))
+      exposed = 0;
+    STAT_ADD(bytes_copied, bytes);
+    touch_performed += bytes;
+
+    if (forced_copies) {
+      forced_copy(dst + first, src + first, bytes);
+    }
+    else {
+      if (!exposed)
+	mprotect_full_page(src + first, bytes, PROT_READ | PROT_WRITE);
+      exposed = 1;
+      mprotect_full_page(dst + first, bytes, PROT_READ | PROT_WRITE);
+      if (zero_pages)
+	copy_skipping_zero_pages(dst + first, src + first, bytes);
+      else
+	copy_bytes(dst + first, src + first, bytes);
+    }
+
+    refresh_protection(dst + first, bytes);
+    if (pages_overlap(dst + first, bytes, src + first, bytes))
+      exposed = 0;
+  }
+
+  refresh_protection(src + first, last - first);
+  return performed;
+}
+
+/* Handles a fault on the page containing 'ptr', which is part of a
+   pending copy. Like the kernel readahead, if the page follows the
+   ones performed on the previous fault on the same copy, twice as
+   many pages as then are performed, from this one on, up to
+   fault_ahead_max; otherwise only fault_ahead_min pages are. The rest
+   of the copy remains pending. Returns the number of bytes in the
+   pages performed. If 'flight' is not NULL, the pages may instead be
+   left for the caller to perform outside of the engine, in which case
+   '*flight' is set to the range in flight (see
+   begin_in_flight_range).
+ */
+static size_t process_fault(void *ptr, pending_copy_t *copy, in_flight_range_t **flight)
+{
+  uintptr_t page = page_number(ptr);
+  size_t window = fault_ahead_min;
+
+  if (copy->fault_window && page == copy->next_fault_page) {
+    STAT_ADD(faults_avoided, copy->fault_window - 1);
+    window = copy->fault_window * 2;
+    if (window > fault_ahead_max)
+      window = fault_ahead_max;
+    if (window < fault_ahead_min)
+      window = fault_ahead_min;
+  }
+
+  // set before the copy is split, so that the remaining part keeps it
+  copy->fault_window = window;
+  copy->next_fault_page = page + window;
+
+  // a fault on a source shared by other pending copies performs them all
+  if (copy->fanout_next != copy && pages_overlap(copy->src, copy->size, ptr, 1))
+    return perform_fanout(copy, page_start(ptr), window << page_shift);
+
+  if (flight) {
+    size_t first, last;
+    pending_range_bounds(copy, page_start(ptr), window << page_shift, 0, &first, &last);
+    if (begin_in_flight_range(copy, first, last - first, flight))
+      return window << page_shift;
+  }
+
+  process_pending_range(copy, page_start(ptr), window << page_shift, 0);
+  return window << page_shift;
+}
+
+/* Returns the current time of the monotonic clock, in nanoseconds.
+   Async-signal-safe.
+ */
+static uint64_t monotonic_time(void) {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Counts a fault on 'ptr', which is part of pending copy 'copy', by
+   the kind of access, and the time it took to handle since 'start'.
+   The time per byte of the 'bytes' performed also updates the cost
+   model, as a moving average.
+ */
+static void count_fault(void *ptr, pending_copy_t *copy, int write, uint64_t start, size_t bytes) {
+
+  uint64_t latency = monotonic_time() - start;
+  unsigned int bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+
+  if (bytes) {
+    uint64_t cost = __atomic_load_n(&fault_ps_per_byte, __ATOMIC_RELAXED);
+    cost = (7 * cost + latency * 1000 / bytes) / 8;
+    __atomic_store_n(&fault_ps_per_byte, cost, __ATOMIC_RELAXED);
+  }
+
+  if (write)
+    STAT_ADD(faults_write, 1);
+  else if (ptr >= page_start(copy->dst) && ptr < copy->dst + copy->size)
+    STAT_ADD(faults_dst_read, 1);
+  else
+    STAT_ADD(faults_src_read, 1);
+
+  if (bucket >= DELAY_MEMCPY_LATENCY_BUCKETS)
+    bucket = DELAY_MEMCPY_LATENCY_BUCKETS - 1;
+  STAT_ADD(fault_latency[bucket], 1);
+}
+
+/* Records an event in the fault trace, if it is on, in place of the
+   oldest one once the buffer is full (see delay_memcpy_trace_event_t).
+   Must be called with the engine lock held. Async-signal-safe.
+ */
+static void trace_event(uint32_t type, uint32_t flags, void *addr, void *dst, void *src,
+			size_t size, size_t bytes, uint64_t time) {
+
+  delay_memcpy_trace_event_t *event;
+
+  if (!trace_capacity)
+    return;
+
+  event = &trace_events[trace_recorded++ % trace_capacity];
+  event->time = time;
+  event->type = type;
+  event->flags = flags;
+  event->addr = (uintptr_t) addr;
+  event->dst = (uintptr_t) dst;
+  event->src = (uintptr_t) src;
+  event->size = size;
+  event->bytes = bytes;
+}
+
+/* Records a fault on 'ptr', which hit pending copy 'copy', handled
+   from time 'start' on by performing 'bytes' bytes.
+ */
+static void trace_fault(void *ptr, pending_copy_t *copy, int write, uint64_t start, size_t bytes) {
+
+  trace_event(DELAY_MEMCPY_TRACE_FAULT, write ? DELAY_MEMCPY_TRACE_WRITE : 0, ptr,
+	      copy->dst, copy->src, copy->size, bytes, start);
+}
+
+/* Returns TRUE (non-zero) if the segmentation fault described by
+   'context' was caused by a write. Always FALSE (zero) on machines
+   where this cannot be told.
+ */
+static int fault_is_write(void *context) {
+
+#if defined(__x86_64__) && defined(REG_ERR)
+  return (((ucontext_t *) context)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#else
+  return 0;
+#endif
+}
+
+/* Segmentation fault handler. If the address that caused the
+   segmentation fault (represented by info->si_addr) is part of a
+   pending copy, this function will perform the copy for the entire
+   page that contains the address. If the pending copy corresponding
+   to the address involves more than one page, the object will be
+   replaced with the remaining pages (before and after the affected
+   page), otherwise it will be removed from the list. If the address
+   is not part of a pending copy page, the process will write a
+   message to the standard error (stderr) output and kill the process.
+ */
+static void delay_memcpy_segv_handler(int signum, siginfo_t *info, void *context) {
+
+  uint64_t start = monotonic_time();
+
+  engine_lock_for_fault();
+
+  pending_copy_t *copy = get_pending_copy(info->si_addr);
+  pending_copy_t first_copy = { 0 };
+  size_t bytes = 0;
+  if (copy == NULL && in_flight_page(info->si_addr)) {
+    // another thread is performing the page: retry once it is done
+    engine_unlock();
+    sched_yield();
+    return;
+  }
+  if (copy == NULL) {
+    pid_t self = syscall(SYS_gettid);
+    if (unresolved_fault_addr == info->si_addr && unresolved_fault_thread == self) {
+      write(STDERR_FILENO, "Segmentation fault!\n", 20);
+      raise(SIGKILL);
+    }
+    unresolved_fault_addr = info->si_addr;
+    unresolved_fault_thread = self;
+  }
+  else {
+    unresolved_fault_addr = NULL;
+    first_copy = *copy;
+  }
+
+  
+  while(copy)
+    {
+      in_flight_range_t *flight = NULL;
+      bytes += process_fault(info->si_addr, copy, &flight);
+      if (flight) {
+	engine_unlock();
+	perform_in_flight_range(flight);
+	engine_lock_for_fault();
+	end_in_flight_range(flight);
+      }
+      copy = get_pending_copy(info->si_addr);
+    }
+
+  if (first_copy.size)
+    trace_fault(info->si_addr, &first_copy, fault_is_write(context), start, bytes);
+  engine_unlock();
+
+  if (first_copy.size)
+    count_fault(info->si_addr, &first_copy, fault_is_write(context), start, bytes);
+}
+
+#ifdef HAVE_USERFAULTFD
+
+/* Body of the thread that handles the page faults on missing
+   destination pages. Each fault is resolved like in the segmentation
+   fault handler; if the page turns out not to be part of a pending
+   copy anymore, it is filled with zeros, as for any fresh anonymous
+   page.
+ */
+static void *userfaultfd_handler_thread(void *arg) {
+
+  struct uffd_msg msg;
+
+  for (;;) {
+
+    ssize_t bytes = read(uffd, &msg, sizeof(msg));
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes != sizeof(msg))
+      break;
+    if (msg.event != UFFD_EVENT_PAGEFAULT)
+      continue;
+
+    void *page = page_start((void *) (uintptr_t) msg.arg.pagefault.address);
+    uint64_t start = monotonic_time();
+    pending_copy_t *copy, first_copy = { 0 };
+    size_t performed = 0;
+
+    engine_lock_for_fault();
+    copy = get_pending_copy(page);
+    if (copy)
+      first_copy = *copy;
+    for (; copy; copy = get_pending_copy(page))
+      performed += process_fault(page, copy, NULL);
+    if (first_copy.size)
+      trace_fault(page, &first_copy, (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0,
+		  start, performed);
+    engine_unlock();
+
+    if (first_copy.size)
+      count_fault(page, &first_copy, (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0, start, performed);
+
+    struct uffdio_zeropage zero = { { (uintptr_t) page, page_size }, 0 };
+    if (ioctl(uffd, UFFDIO_ZEROPAGE, &zero) < 0 && errno == EEXIST)
+      ioctl(uffd, UFFDIO_WAKE, &zero.range);
+  }
+
+  return NULL;
+}
+
+/* Opens the userfaultfd file descriptor and starts the thread that
+   handles its faults. Returns 0 on success, or -1 if userfaultfd is
+   not available.
+ */
+static int userfaultfd_start(void) {
+
+  struct uffdio_api api = { UFFD_API, 0, 0 };
+  pthread_t thread;
+  sigset_t all, old;
+  int fd, error;
+
+  if (uffd >= 0)
+    return 0;
+
+  fd = syscall(SYS_userfaultfd, O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (ioctl(fd, UFFDIO_API, &api) < 0)
+    goto fail;
+
+  if (open_self_mem() < 0)
+    goto fail;
+
+  uffd = fd;
+
+  // The thread must not run any signal handler of the process
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  error = pthread_create(&thread, NULL, userfaultfd_handler_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (error) {
+    uffd = -1;
+    goto fail;
+  }
+  pthread_detach(thread);
+  return 0;
+
+ fail:
+  close(fd);
+  return -1;
+}
+
+/* Registers the pending copy of the page aligned destination range
+   'dst' with 'size' bytes to be filled through userfaultfd: the range
+   is registered for missing page faults and its pages are dropped.
+   Any older pending copy involving those pages is performed first.
+   Returns the new pending copy object, or NULL if the range cannot be
+   handled this way (for instance, if it is not anonymous memory, or
+   is shared memory whose pages stay in memory when dropped).
+ */
+static pending_copy_t *add_missing_copy(void *dst, void *src, size_t size) {
+
+  struct uffdio_register reg = { { (uintptr_t) dst, size }, UFFDIO_REGISTER_MODE_MISSING, 0 };
+  pending_copy_t *copy;
+
+  resolve_older_copies(dst, size, last_copy_seq + 1);
+
+  if (ioctl(uffd, UFFDIO_REGISTER, &reg) < 0)
+    return NULL;
+
+  copy = add_pending_copy(dst, src, size, NULL, PENDING_COPY_MISSING);
+  if (!copy)
+    return NULL;
+
+  madvise(dst, size, MADV_DONTNEED);
+
+  // the pages of a shared mapping keep their data, so they would
+  // never fault
+  if (has_resident_pages(dst, size)) {
+    remove_pending_copy(copy);
+    ioctl(uffd, UFFDIO_UNREGISTER, &reg.range);
+    return NULL;
+  }
+
+  return copy;
+}
+
+#endif
+
+/* Registers a pending copy with the userfaultfd backend. The pages
+   that are entirely covered by the destination are filled through
+   userfaultfd, while the partial pages at either end become regular
+   protected pending copies. Returns 0 on success, or -1 if the copy
+   must go through the regular path instead.
+ */
+static int delay_memcpy_missing(void *dst, void *src, size_t size) {
+
+#ifdef HAVE_USERFAULTFD
+  void *first = page_start(dst + page_size - 1);
+  void *last = page_start(dst + size);
+  size_t head = first - dst;
+  size_t tail = dst + size - last;
+
+  if (uffd < 0 || last <= first)
+    return -1;
+
+  if (!add_missing_copy(first, src + head, last - first))
+    return -1;
+
+  if (head && !add_pending_copy(dst, src, head, NULL, PENDING_COPY_PROTECTED))
+    copy_now(dst, src, head);
+  if (tail && !add_pending_copy(last, src + size - tail, tail, NULL, PENDING_COPY_PROTECTED))
+    copy_now(last, src + size - tail, tail);
+
+  // protect only once all the parts are registered, as making room
+  // for them may refresh the protection of the same pages
+  protect_new_copy(src, size, PROT_READ);
+  if (head)
+    protect_new_copy(dst, head, PROT_NONE);
+  if (tail)
+    protect_new_copy(last, tail, PROT_NONE);
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* Registers a pending copy between two buffers allocated with
+   delay_memcpy_alloc, at the same offset within a page. The pages
+   that are entirely covered by the destination are replaced by a
+   private mapping of the source pages, so the copy is only performed
+   by the kernel, page by page, when either side is written. Writes to
+   the destination duplicate the page on their own; the source is
+   made read-only, so that the destination gets its own copy before
+   the source changes. The partial pages at either end become regular
+   protected pending copies. Returns 0 on success, or -1 if the copy
+   must go through the regular path instead.
+ */
+static int delay_memcpy_remapped(void *dst, void *src, size_t size) {
+
+  void *first = page_start(dst + page_size - 1);
+  void *last = page_start(dst + size);
+  size_t head = first - dst;
+  size_t tail = dst + size - last;
+  remap_buffer_t *from, *to;
+
+  if (last <= first || page_start(src + head) != src + head)
+    return -1;
+  if (src < dst + size && dst < src + size)
+    return -1;
+
+  from = find_remap_buffer(src + head, last - first);
+  to = find_remap_buffer(first, last - first);
+  if (!from || !to)
+    return -1;
+  if (from->private_start < src + head + (last - first) && from->private_end > src + head)
+    return -1;
+
+  // the previous content of the destination pages is about to go away
+  resolve_older_copies(first, last - first, last_copy_seq + 1);
+
+  if (mmap(first, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	   from->fd, src + head - from->start) == MAP_FAILED)
+    return -1;
+
+  if (to->private_start == to->private_end) {
+    to->private_start = first;
+    to->private_end = last;
+  }
+  else {
+    if (first < to->private_start)
+      to->private_start = first;
+    if (last > to->private_end)
+      to->private_end = last;
+  }
+
+  if (!add_pending_copy(first, src + head, last - first, NULL, PENDING_COPY_REMAPPED))
+    actual_copy_remapped(first, src + head, last - first);
+
+  if (head && !add_pending_copy(dst, src, head, NULL, PENDING_COPY_PROTECTED))
+    copy_now(dst, src, head);
+  if (tail && !add_pending_copy(last, src + size - tail, tail, NULL, PENDING_COPY_PROTECTED))
+    copy_now(last, src + size - tail, tail);
+
+  // protect only once all the parts are registered, as making room
+  // for them may refresh the protection of the same pages
+  protect_new_copy(src, size, PROT_READ);
+  if (head)
+    protect_new_copy(dst, head, PROT_NONE);
+  if (tail)
+    protect_new_copy(last, tail, PROT_NONE);
+
+  return 0;
+}
+
+void reset_pending_copy_slots()
+{
+  engine_lock();
+  while (first_pending_copy)
+    {
+      pending_copy_t *copy = first_pending_copy;
+
+      if (reads_memory(copy->kind))
+	mprotect_full_page( copy->src, copy->size, PROT_READ | PROT_WRITE );
+      mprotect_full_page( copy->dst, copy->size, PROT_READ | PROT_WRITE );
+
+      STAT_ADD(bytes_never_copied, copy->size);
+      remove_pending_copy(copy);
+    }
+  engine_unlock();
+}
+
+/* Reads the system page size, which is also the default page size,
+   if not done yet.
+ */
+static void initialize_page_size(void) {
+
+  if (system_page_size)
+    return;
+  system_page_size = page_size = sysconf(_SC_PAGESIZE);
+  system_page_shift = page_shift = __builtin_ctzl(page_size);
+}
+
+/* Performs every pending copy that involves a page of the range from
+   'ptr' to 'ptr+size-1', either as source or as destination, so that
+   the range can be handed to a system call or a device: the kernel
+   returns EFAULT on protected pages instead of raising a segmentation
+   fault. The rest of those copies remains pending.
+ */
+void delay_memcpy_sync(void *ptr, size_t size) {
+
+  // nothing pending means nothing to perform
+  if (size == 0 || !__atomic_load_n(&first_pending_copy, __ATOMIC_ACQUIRE))
+    return;
+
+  engine_lock();
+  trace_event(DELAY_MEMCPY_TRACE_SYNC, 0, NULL, ptr, NULL, size, 0, monotonic_time());
+  resolve_older_copies(ptr, size, last_copy_seq + 1);
+  engine_unlock();
+}
+
+/* Page range, used to sort and merge the ranges that
+   delay_memcpy_flush_all makes accessible. */
+static int compare_page_ranges(const void *a, const void *b) {
+
+  const page_range_t *x = a, *y = b;
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/* Sorts 'count' page ranges and merges the overlapping or adjacent
+   ones, in place. Returns the number of runs of pages left.
+ */
+static size_t merge_page_ranges(page_range_t *ranges, size_t count) {
+
+  size_t i, runs;
+
+  if (count == 0)
+    return 0;
+
+  qsort(ranges, count, sizeof(*ranges), compare_page_ranges);
+
+  for (i = 1, runs = 0; i < count; i++) {
+    if (ranges[i].first <= ranges[runs].last + 1) {
+      if (ranges[i].last > ranges[runs].last)
+	ranges[runs].last = ranges[i].last;
+    }
+    else
+      ranges[++runs] = ranges[i];
+  }
+  return runs + 1;
+}
+
+/* Makes the source and protected destination of every pending copy
+   readable and writable, merging overlapping or adjacent ranges so
+   that each run of pages takes a single call to mprotect. The copies
+   must be out of the page index already. Returns 0 on success, or -1
+   if there was no memory to sort the ranges.
+ */
+static int unprotect_pending_copies(void) {
+
+  pending_copy_t *copy;
+  page_range_t *ranges;
+  size_t count = 0, i, runs;
+
+  ranges = malloc(2 * pending_copies_in_use * sizeof(*ranges));
+  if (!ranges)
+    return -1;
+
+  for (copy = first_pending_copy; copy; copy = copy->next) {
+    if (reads_memory(copy->kind)) {
+      ranges[count].first = page_number(copy->src);
+      ranges[count++].last = page_number(copy->src + copy->size - 1);
+    }
+    if (protects_destination(copy->kind)) {
+      ranges[count].first = page_number(copy->dst);
+      ranges[count++].last = page_number(copy->dst + copy->size - 1);
+    }
+  }
+
+  runs = merge_page_ranges(ranges, count);
+
+  for (i = 0; i < runs; i++)
+    mprotect((void *) (ranges[i].first << page_shift),
+	     (ranges[i].last + 1 - ranges[i].first) << page_shift, PROT_READ | PROT_WRITE);
+
+  free(ranges);
+  return 0;
+}
+
+/* Part of a pending copy performed by a flush worker. */
+typedef struct flush_chunk {
+  void *dst;
+  void *src;
+  size_t size;
+
+  /* Flag to use the streaming copy kernel, as the whole copy is large */
+  int streaming;
+} flush_chunk_t;
+
+struct flush_job;
+
+/* Thread performing chunks of a flush. Each worker owns a range of
+   chunks, packed as the index of the next one in the upper 32 bits
+   and the index past the last one in the lower 32 bits, so that it
+   takes chunks from the front and other workers steal from the back
+   with a single compare and swap.
+ */
+typedef struct flush_worker {
+  uint64_t chunks;
+  void *bounce;
+  pthread_t thread;
+  struct flush_job *job;
+} flush_worker_t;
+
+/* Flush shared by its workers. */
+typedef struct flush_job {
+  flush_chunk_t *chunks;
+  flush_worker_t *workers;
+  unsigned int count;
+} flush_job_t;
+
+/* Takes the next chunk of a worker. Returns its index, or -1 if the
+   worker has none left.
+ */
+static long take_flush_chunk(flush_worker_t *worker) {
+
+  uint64_t range = __atomic_load_n(&worker->chunks, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    uint32_t next = range >> 32, end = range;
+    if (next >= end)
+      return -1;
+    if (__atomic_compare_exchange_n(&worker->chunks, &range, range + (1ULL << 32), 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return next;
+  }
+}
+
+/* Steals the back half of the chunks of another worker, which become
+   those of 'thief'. Returns TRUE (non-zero) if any was stolen, or
+   FALSE once no worker has any chunk left.
+ */
+static int steal_flush_chunks(flush_worker_t *thief) {
+
+  flush_job_t *job = thief->job;
+  unsigned int self = thief - job->workers;
+  unsigned int i;
+
+  for (i = 1; i < job->count; i++) {
+
+    flush_worker_t *victim = &job->workers[(self + i) % job->count];
+    uint64_t range = __atomic_load_n(&victim->chunks, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+      uint32_t next = range >> 32, end = range;
+      uint32_t middle = next + (end - next) / 2;
+      if (next >= end)
+	break;
+      if (__atomic_compare_exchange_n(&victim->chunks, &range, ((uint64_t) next << 32) | middle, 0,
+				      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	__atomic_store_n(&thief->chunks, ((uint64_t) middle << 32) | end, __ATOMIC_RELEASE);
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Body of a flush worker, and of the thread that started the flush:
+   performs its own chunks, then steals from the others, until none
+   is left. With forced copies, the chunks are written through
+   /proc/self/mem and their pages keep their protection; otherwise
+   the pages were made accessible beforehand.
+ */
+static void *flush_worker_main(void *arg) {
+
+  flush_worker_t *worker = arg;
+  long index;
+
+  do {
+    while ((index = take_flush_chunk(worker)) >= 0) {
+      flush_chunk_t *chunk = &worker->job->chunks[index];
+      if (forced_copies)
+	forced_copy_through(chunk->dst, chunk->src, chunk->size, worker->bounce);
+      else if (chunk->streaming && streaming_copy)
+	streaming_copy(chunk->dst, chunk->src, chunk->size);
+      else
+	memcpy(chunk->dst, chunk->src, chunk->size);
+    }
+  } while (steal_flush_chunks(worker));
+
+  return NULL;
+}
+
+/* Byte range of the source or destination of a pending copy, used to
+   find the copies that are independent of all the others. */
+typedef struct flush_interval {
+  void *start;
+  void *end;
+  size_t copy;
+  int is_dst;
+} flush_interval_t;
+
+static int compare_flush_intervals(const void *a, const void *b) {
+
+  const flush_interval_t *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Sets 'independent[i]' to TRUE (non-zero) for each of the 'count'
+   pending 'copies' that is protected and shares no byte with another
+   one, other than both reading it, so that it may be performed at any
+   time with respect to the others. Returns 0 on success, or -1 if
+   there was no memory.
+ */
+static int find_independent_copies(pending_copy_t **copies, size_t count, char *independent) {
+
+  flush_interval_t *intervals = malloc(2 * count * sizeof(*intervals));
+  size_t i, j;
+
+  if (!intervals)
+    return -1;
+
+  for (i = 0; i < count; i++) {
+    if (!reads_memory(copies[i]->kind))
+      intervals[2 * i] = (flush_interval_t) { NULL, NULL, i, 0 };
+    else
+      intervals[2 * i] = (flush_interval_t) { copies[i]->src, copies[i]->src + copies[i]->size, i, 0 };
+    intervals[2 * i + 1] = (flush_interval_t) { copies[i]->dst, copies[i]->dst + copies[i]->size, i, 1 };
+    independent[i] = copies[i]->kind == PENDING_COPY_PROTECTED;
+  }
+
+  qsort(intervals, 2 * count, sizeof(*intervals), compare_flush_intervals);
+
+  for (i = 0; i < 2 * count; i++)
+    for (j = i + 1; j < 2 * count && intervals[j].start < intervals[i].end; j++)
+      if (intervals[i].copy != intervals[j].copy && (intervals[i].is_dst || intervals[j].is_dst))
+	independent[intervals[i].copy] = independent[intervals[j].copy] = 0;
+
+  free(intervals);
+  return 0;
+}
+
+/* Performs, with flush_threads threads, the pending copies that are
+   independent of all the others (see find_independent_copies), if
+   they add up to at least FLUSH_PARALLEL_MIN bytes. They are sliced
+   into chunks of FLUSH_CHUNK_SIZE bytes, or a page if larger, spread
+   evenly among the workers, and idle workers steal chunks from busy
+   ones. Without forced copies, the pages involved are made accessible
+   up front; with them, the chunks are written through /proc/self/mem,
+   and the pages get the protection required by the remaining copies
+   at the end. Either way, each run of pages takes a single call to
+   mprotect. The other copies remain pending. Called with the engine.
+ */
+static void flush_in_parallel(void) {
+
+  size_t count = pending_copies_in_use, total = 0, chunk_count = 0;
+  size_t chunk_size = FLUSH_CHUNK_SIZE > page_size ? FLUSH_CHUNK_SIZE : page_size;
+  size_t i, j, runs = 0;
+  pending_copy_t **copies = malloc(count * sizeof(*copies));
+  char *independent = malloc(count);
+  flush_chunk_t *chunks = NULL;
+  page_range_t *ranges = NULL;
+  flush_worker_t workers[MAX_FLUSH_THREADS];
+  flush_job_t job;
+  pending_copy_t *copy;
+  sigset_t all, old;
+  unsigned int w;
+
+  if (!copies || !independent)
+    goto done;
+
+  for (copy = first_pending_copy, i = 0; copy && i < count; copy = copy->next)
+    copies[i++] = copy;
+  count = i;
+
+  if (find_independent_copies(copies, count, independent) < 0)
+    goto done;
+
+  for (i = 0; i < count; i++)
+    if (independent[i]) {
+      total += copies[i]->size;
+      chunk_count += ((uintptr_t) copies[i]->dst + copies[i]->size -
+		      ((uintptr_t) copies[i]->dst & -chunk_size) + chunk_size - 1) / chunk_size;
+    }
+  if (total < FLUSH_PARALLEL_MIN || chunk_count > UINT32_MAX)
+    goto done;
+
+  chunks = malloc(chunk_count * sizeof(*chunks));
+  ranges = malloc(2 * count * sizeof(*ranges));
+  if (!chunks || !ranges)
+    goto done;
+
+  // chunk boundaries fall on pages of the destination, aligned to the chunk size
+  for (i = 0, chunk_count = 0; i < count; i++) {
+    size_t offset = 0, size;
+    if (!independent[i])
+      continue;
+    copy = copies[i];
+    for (; offset < copy->size; offset += size) {
+      size = chunk_size - ((uintptr_t) (copy->dst + offset) & (chunk_size - 1));
+      if (size > copy->size - offset)
+	size = copy->size - offset;
+      chunks[chunk_count++] = (flush_chunk_t) { copy->dst + offset, copy->src + offset, size,
+						copy->size >= streaming_threshold };
+    }
+    page_index_remove(copy);
+    ranges[runs++] = (page_range_t) { page_number(copy->src), page_number(copy->src + copy->size - 1) };
+    ranges[runs++] = (page_range_t) { page_number(copy->dst), page_number(copy->dst + copy->size - 1) };
+  }
+  runs = merge_page_ranges(ranges, runs);
+
+  if (!forced_copies)
+    for (i = 0; i < runs; i++)
+      mprotect((void *) (ranges[i].first << page_shift),
+	       (ranges[i].last + 1 - ranges[i].first) << page_shift, PROT_READ | PROT_WRITE);
+
+  job.chunks = chunks;
+  job.workers = workers;
+  job.count = flush_threads;
+  for (w = 0; w < job.count; w++) {
+    workers[w].chunks = ((uint64_t) (chunk_count * w / job.count) << 32) | (chunk_count * (w + 1) / job.count);
+    workers[w].bounce = forced_copies ? malloc(page_size) : NULL;
+    workers[w].job = &job;
+  }
+  if (forced_copies && !workers[0].bounce)
+    workers[0].bounce = bounce_page;
+
+  // The workers must not run any signal handler of the process. Those
+  // that cannot be started, or have no bounce page, leave their chunks
+  // to be stolen.
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (w = 1; w < job.count; w++)
+    if ((forced_copies && !workers[w].bounce) ||
+	pthread_create(&workers[w].thread, NULL, flush_worker_main, &workers[w]))
+      workers[w].job = NULL;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  flush_worker_main(&workers[0]);
+  for (w = 1; w < job.count; w++)
+    if (workers[w].job)
+      pthread_join(workers[w].thread, NULL);
+
+  for (w = 0; w < job.count; w++)
+    if (workers[w].bounce != bounce_page)
+      free(workers[w].bounce);
+
+  for (i = 0; i < count; i++)
+    if (independent[i]) {
+      STAT_ADD(bytes_copied, copies[i]->size);
+      touch_performed += copies[i]->size;
+      remove_pending_copy(copies[i]);
+    }
+
+  if (forced_copies)
+    for (j = 0; j < runs; j++)
+      refresh_protection((void *) (ranges[j].first << page_shift),
+			 (ranges[j].last + 1 - ranges[j].first) << page_shift);
+
+ done:
+  free(copies);
+  free(independent);
+  free(chunks);
+  free(ranges);
+}
+
+/* Performs every pending copy, in the order of the list. The pages
+   involved are made accessible with one call to mprotect per run of
+   pages, rather than once per copy and again for each copy they are
+   involved in. If other threads may run meanwhile (see
+   delay_memcpy_start_drain), the copies are performed one by one, so
+   that no page is accessible before it is complete.
+
+   With more than one flush thread (see delay_memcpy_set_flush_threads),
+   the copies that do not depend on any other are first performed in
+   parallel, whether or not other threads may run (see
+   flush_in_parallel).
+ */
+void delay_memcpy_flush_all(void) {
+
+  pending_copy_t *copy;
+
+  engine_lock();
+  trace_event(DELAY_MEMCPY_TRACE_FLUSH, 0, NULL, NULL, NULL, 0, 0, monotonic_time());
+
+  if (flush_threads > 1 && first_pending_copy)
+    flush_in_parallel();
+
+  if (!forced_copies && first_pending_copy) {
+
+    for (copy = first_pending_copy; copy; copy = copy->next)
+      page_index_remove(copy);
+
+    if (unprotect_pending_copies() == 0) {
+      while ((copy = first_pending_copy)) {
+	STAT_ADD(bytes_copied, copy->size);
+	touch_performed += copy->size;
+	if (copy->kind == PENDING_COPY_MISSING)
+	  actual_copy_missing(copy->dst, copy->src, copy->size);
+	else if (copy->kind == PENDING_COPY_REMAPPED)
+	  actual_copy_remapped(copy->dst, copy->src, copy->size);
+	else if (copy->kind == PENDING_COPY_FILE)
+	  actual_read_file(copy->dst, copy->operand, (uintptr_t) copy->src, copy->size);
+	else if (copy->kind == PENDING_COPY_FILL)
+	  memset(copy->dst, copy->operand, copy->size);
+	else
+	  copy_bytes(copy->dst, copy->src, copy->size);
+	remove_pending_copy(copy);
+      }
+    }
+    else {
+      for (copy = first_pending_copy; copy; copy = copy->next)
+	page_index_add(copy);
+    }
+  }
+
+  while (first_pending_copy)
+    materialize_pending_copy(first_pending_copy, 0, first_pending_copy->size);
+
+  engine_unlock();
+}
+
+/* Sets the number of threads, the caller included, that
+   delay_memcpy_flush_all uses to perform the copies that do not
+   depend on any other. 0 stands for the number of CPUs online, and 1,
+   the default, performs every copy on the calling thread. Returns 0
+   on success, or -1 if 'threads' exceeds MAX_FLUSH_THREADS.
+ */
+int delay_memcpy_set_flush_threads(unsigned int threads) {
+
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+    if (threads > MAX_FLUSH_THREADS)
+      threads = MAX_FLUSH_THREADS;
+  }
+  if (threads > MAX_FLUSH_THREADS)
+    return -1;
+
+  engine_lock();
+  flush_threads = threads;
+  engine_unlock();
+  return 0;
+}
+
+/* Returns the number of threads used by delay_memcpy_flush_all. */
+unsigned int delay_memcpy_get_flush_threads(void) {
+
+  return flush_threads;
+}
+
+/* Drops the pending copies to the range from 'dst' to 'dst+size-1',
+   as far as those bytes are concerned. The rest of those copies
+   remains pending. Bytes of missing or remapped destination pages
+   only partially within the range are copied, as those pages can only
+   be filled as a whole.
+ */
+static void discard_pending_destinations(void *dst, size_t size) {
+
+  pending_copy_t *copy;
+
+  while ((copy = find_pending_destination(dst, size, 0))) {
+
+    size_t first = dst > copy->dst ? dst - copy->dst : 0;
+    size_t last = dst + size < copy->dst + copy->size ? dst + size - copy->dst : copy->size;
+
+    // missing or remapped destinations are page aligned, and only
+    // whole pages can be left unfilled
+    if (copy->kind == PENDING_COPY_MISSING || copy->kind == PENDING_COPY_REMAPPED) {
+      size_t first_page = (first + page_size - 1) & -page_size;
+      size_t last_page = last & -page_size;
+
+      if (first_page >= last_page) {
+	materialize_pending_copy(copy, first, last - first);
+	continue;
+      }
+      if (first < first_page) {
+	materialize_pending_copy(copy, first, first_page - first);
+	continue;
+      }
+      if (last > last_page) {
+	materialize_pending_copy(copy, last_page, last - last_page);
+	continue;
+      }
+    }
+
+    discard_pending_range(copy, first, last - first);
+  }
+}
+
+/* Drops the pending copies to the range from 'dst' to 'dst+size-1',
+   as far as those bytes are concerned, typically because the range is
+   about to be overwritten. The rest of those copies remains pending.
+   The content of the range is unspecified until it is written, except
+   that bytes of missing or remapped destination pages only partially
+   within the range are copied. Pending copies from the range keep
+   reading what it held when they were requested.
+ */
+void delay_memcpy_cancel(void *dst, size_t size) {
+
+  if (size == 0 || !__atomic_load_n(&first_pending_copy, __ATOMIC_ACQUIRE))
+    return;
+
+  engine_lock();
+  trace_event(DELAY_MEMCPY_TRACE_CANCEL, 0, NULL, dst, NULL, size, 0, monotonic_time());
+  discard_pending_destinations(dst, size);
+  engine_unlock();
+}
+
+static void calibrate_cost_model(void);
 
 /* Initializes the data structures and global variables used in the
    delay memcpy process. Changes the signal handler for segmentation
    fault to the handler used by this process.
  */
-void initialize_delay_memcpy_data(void) {
+void initialize_delay_memcpy_data(void) {
+
+  struct sigaction sa;
+  sa.sa_sigaction = delay_memcpy_segv_handler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+
+  initialize_page_size();
+  select_streaming_copy();
+  if (fault_ahead_max < DEFAULT_FAULT_AHEAD_MAX >> page_shift)
+    fault_ahead_max = DEFAULT_FAULT_AHEAD_MAX >> page_shift;
+
+  if (!page_index_buckets)
+    page_index_resize(PAGE_INDEX_INITIAL_BUCKET_BITS);
+  reserve_pending_copies();
+
+  const char *name = getenv("DELAY_MEMCPY_BACKEND");
+  if (name && !strcmp(name, "userfaultfd"))
+    delay_memcpy_set_backend(DELAY_MEMCPY_BACKEND_USERFAULTFD);
+
+  name = getenv("DELAY_MEMCPY_GRANULARITY");
+  if (name && !strcmp(name, "huge"))
+    delay_memcpy_set_granularity(delay_memcpy_huge_page_size());
+  else if (name)
+    delay_memcpy_set_granularity(strtoul(name, NULL, 0));
+
+  name = getenv("DELAY_MEMCPY_FLUSH_THREADS");
+  if (name)
+    delay_memcpy_set_flush_threads(strtoul(name, NULL, 0));
+
+  name = getenv("DELAY_MEMCPY_ZERO_PAGES");
+  if (name)
+    delay_memcpy_set_zero_pages(strtol(name, NULL, 0));
+
+  calibrate_cost_model();
+
+  // after the calibration, whose copies and faults are not part of
+  // the workload
+  name = getenv("DELAY_MEMCPY_TRACE");
+  if (name)
+    delay_memcpy_start_trace(strtoul(name, NULL, 0));
+}
+
+/* Returns the size of the transparent huge pages of the system, as
+   reported by /sys/kernel/mm/transparent_hugepage/hpage_pmd_size, or
+   2 MB if it cannot be read.
+ */
+size_t delay_memcpy_huge_page_size(void) {
+
+  char text[32];
+  size_t size = 2 * 1024 * 1024;
+  int fd = open("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", O_RDONLY | O_CLOEXEC);
+
+  if (fd >= 0) {
+    ssize_t bytes = read(fd, text, sizeof(text) - 1);
+    if (bytes > 0) {
+      text[bytes] = 0;
+      size = strtoul(text, NULL, 10);
+    }
+    close(fd);
+  }
+  return size;
+}
+
+/* Sets the unit in which pending copies are tracked: protection,
+   splitting and fault handling all work on aligned blocks of
+   'granularity' bytes, which must be a power of two no smaller than
+   the system page size. A touched block is copied as a whole, and a
+   copy shares its first and last blocks with whatever else lies
+   there, so buffers should be aligned to the granularity; in return,
+   large copies take far fewer faults, and far fewer mappings and
+   page table entries once their protection is changed. Using the
+   huge page size (see delay_memcpy_huge_page_size) on buffers backed
+   by transparent huge pages or hugetlbfs also keeps the huge pages
+   intact. The granularity can also be selected by setting the
+   environment variable DELAY_MEMCPY_GRANULARITY to a number of bytes,
+   or to "huge", before calling initialize_delay_memcpy_data. Returns
+   0 on success, or -1 if the granularity is not valid or some copies
+   are pending.
+ */
+int delay_memcpy_set_granularity(size_t granularity) {
+
+  unsigned int shift;
+  int result = -1;
+
+  initialize_page_size();
+  if (granularity < system_page_size || (granularity & (granularity - 1)))
+    return -1;
+  shift = __builtin_ctzl(granularity);
+
+  engine_lock();
+  if (first_pending_copy)
+    goto out;
+
+  // the bounce page holds a whole page at the current granularity
+  if (bounce_page && granularity != page_size) {
+    void *page = mmap(NULL, granularity, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+      goto out;
+    munmap(bounce_page, page_size);
+    bounce_page = page;
+  }
+
+  // keep the same fault-ahead window, in bytes
+  fault_ahead_min = ((fault_ahead_min << page_shift) + granularity - 1) >> shift;
+  fault_ahead_max = ((fault_ahead_max << page_shift) + granularity - 1) >> shift;
+
+  page_size = granularity;
+  page_shift = shift;
+  result = 0;
+
+ out:
+  engine_unlock();
+  return result;
+}
+
+/* Returns the unit in which pending copies are tracked. */
+size_t delay_memcpy_get_granularity(void) {
+
+  return page_size;
+}
+
+/* Selects how new pending copies are handled:
+
+   - DELAY_MEMCPY_BACKEND_SIGSEGV: the destination pages are protected
+     with mprotect, and copied in the segmentation fault handler when
+     touched.
+
+   - DELAY_MEMCPY_BACKEND_USERFAULTFD: the destination pages entirely
+     covered by a copy are dropped and registered with userfaultfd,
+     and a dedicated thread fills them with UFFDIO_COPY when touched,
+     without any protection change. The partial pages at either end,
+     and writes to the source, still go through the segmentation fault
+     handler. Destinations that cannot be registered (for instance,
+     file mappings) also use the regular path.
+
+   The backend can also be selected by setting the environment
+   variable DELAY_MEMCPY_BACKEND to "userfaultfd" before calling
+   initialize_delay_memcpy_data. Copies already pending are not
+   affected. Returns 0 on success, or -1 if the backend is not
+   available.
+ */
+int delay_memcpy_set_backend(int new_backend) {
+
+  int result = 0;
+
+  engine_lock();
+  if (new_backend == DELAY_MEMCPY_BACKEND_SIGSEGV)
+    backend = new_backend;
+#ifdef HAVE_USERFAULTFD
+  else if (new_backend == DELAY_MEMCPY_BACKEND_USERFAULTFD && userfaultfd_start() == 0)
+    backend = new_backend;
+#endif
+  else
+    result = -1;
+  engine_unlock();
+
+  return result;
+}
+
+/* Returns the backend used for new pending copies. */
+int delay_memcpy_get_backend(void) {
+
+  return backend;
+}
+
+/* Sets the maximum number of pending copies. Once reached, the oldest
+   pending copy is performed when a new one is requested. Objects are
+   allocated as needed, so a large capacity costs nothing until it is
+   used. If the new capacity is lower than the number of copies
+   currently pending, the oldest ones are performed. Returns 0 on
+   success, or -1 if the capacity is zero.
+ */
+int delay_memcpy_set_capacity(size_t capacity) {
+
+  if (capacity == 0)
+    return -1;
+
+  engine_lock();
+  max_pending_copies = capacity;
+  while (pending_copies_in_use > max_pending_copies) {
+    STAT_ADD(forced_evictions, 1);
+    materialize_pending_copy(first_pending_copy, 0, first_pending_copy->size);
+  }
+  engine_unlock();
+
+  return 0;
+}
+
+/* Returns the maximum number of pending copies. */
+size_t delay_memcpy_get_capacity(void) {
+
+  return max_pending_copies;
+}
+
+/* Makes sure at least 'count' pending copies can be registered
+   without mapping more memory, so that the registration itself has a
+   predictable cost. Returns 0 on success, or -1 if the memory could
+   not be mapped.
+ */
+int delay_memcpy_reserve(size_t count) {
+
+  size_t free_count;
+  int result = -1;
+
+  engine_lock();
+
+  free_count = pending_copy_arena.free_count;
+  if (count > free_count &&
+      arena_grow(&pending_copy_arena, count - free_count) < 0)
+    goto out;
+
+  free_count = page_index_arena.free_count;
+  count *= PAGE_INDEX_ENTRIES_PER_COPY;
+  if (count > free_count &&
+      arena_grow(&page_index_arena, count - free_count) < 0)
+    goto out;
+
+  while (page_index_arena.capacity > (2UL << page_index_bucket_bits))
+    if (page_index_resize(page_index_bucket_bits + 1) < 0)
+      goto out;
+
+  result = 0;
+ out:
+  engine_unlock();
+  return result;
+}
+
+/* Maps the 'size' bytes of file 'fd' as a shared mapping aligned to
+   the page size, which may be larger than the system page size (see
+   delay_memcpy_set_granularity), by reserving enough address space
+   to find an aligned range and unmapping the rest. Larger pages are
+   also advised to be backed by huge pages. Returns the mapping, or
+   NULL on failure.
+ */
+static void *map_aligned(size_t size, int fd) {
+
+  size_t slack = page_size - system_page_size;
+  void *area, *start;
+
+  area = mmap(NULL, size + slack, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED)
+    return NULL;
+
+  start = page_start(area + slack);
+  if (mmap(start, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(area, size + slack);
+    return NULL;
+  }
+
+  if (start > area)
+    munmap(area, start - area);
+  if (area + size + slack > start + size)
+    munmap(start + size, area + size + slack - (start + size));
+
+#ifdef MADV_HUGEPAGE
+  if (page_size > system_page_size)
+    madvise(start, size, MADV_HUGEPAGE);
+#endif
+  return start;
+}
+
+/* Allocates a buffer of 'size' bytes, rounded up to a whole number of
+   pages, backed by its own memfd. A copy between two such buffers,
+   where the source and destination start at the same offset within a
+   page, does not copy the pages entirely covered by the destination:
+   they are mapped as a private, copy-on-write view of the source
+   pages, and the kernel only duplicates the pages that get written on
+   either side. Returns the buffer, or NULL on failure.
+ */
+void *delay_memcpy_alloc(size_t size) {
+
+  remap_buffer_t *buffer;
+  void *start;
+  int fd;
+
+  if (size == 0 || open_self_mem() < 0)
+    return NULL;
+  size = (size + page_size - 1) & -page_size;
+
+  fd = memfd_create("delay_memcpy", MFD_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (ftruncate(fd, size) < 0)
+    goto fail;
+
+  start = map_aligned(size, fd);
+  if (!start)
+    goto fail;
+
+  buffer = malloc(sizeof(*buffer));
+  if (!buffer) {
+    munmap(start, size);
+    goto fail;
+  }
+  buffer->start = start;
+  buffer->size = size;
+  buffer->fd = fd;
+  buffer->private_start = buffer->private_end = NULL;
+
+  engine_lock();
+  buffer->next = remap_buffers;
+  remap_buffers = buffer;
+  engine_unlock();
+
+  return start;
+
+ fail:
+  close(fd);
+  return NULL;
+}
+
+/* Frees a buffer allocated with delay_memcpy_alloc. Any pending copy
+   involving the buffer is performed first.
+ */
+void delay_memcpy_free(void *ptr) {
+
+  remap_buffer_t **link;
+  remap_buffer_t *buffer;
+
+  engine_lock();
+  for (link = &remap_buffers; (buffer = *link) && buffer->start != ptr; link = &buffer->next);
+  if (buffer) {
+    *link = buffer->next;
+    resolve_older_copies(buffer->start, buffer->size, last_copy_seq + 1);
+    munmap(buffer->start, buffer->size);
+    close(buffer->fd);
+  }
+  engine_unlock();
+
+  free(buffer);
+}
+
+/* Sets the smallest and largest amount of data, in bytes, performed
+   when a page of a pending copy is touched. Faults that do not follow
+   the previous one on the same copy perform 'min_bytes'; each fault
+   that continues a sequential access doubles the amount, up to
+   'max_bytes', so that a linear scan of a large copy only faults a
+   few times. Both are rounded up to whole pages. Setting both to one
+   page performs exactly the page that is touched. Returns 0 on
+   success, or -1 if 'min_bytes' is zero or larger than 'max_bytes'.
+ */
+int delay_memcpy_set_fault_ahead(size_t min_bytes, size_t max_bytes) {
+
+  if (min_bytes == 0 || min_bytes > max_bytes)
+    return -1;
+
+  engine_lock();
+  fault_ahead_min = (min_bytes + page_size - 1) >> page_shift;
+  fault_ahead_max = (max_bytes + page_size - 1) >> page_shift;
+  engine_unlock();
+
+  return 0;
+}
+
+/* Returns the smallest and largest amount of data, in bytes, performed
+   when a page of a pending copy is touched.
+ */
+void delay_memcpy_get_fault_ahead(size_t *min_bytes, size_t *max_bytes) {
+
+  *min_bytes = fault_ahead_min << page_shift;
+  *max_bytes = fault_ahead_max << page_shift;
+}
+
+/* Returns the number of faults avoided so far by performing pages
+   ahead of sequential accesses.
+ */
+unsigned long delay_memcpy_get_faults_avoided(void) {
+
+  return __atomic_load_n(&stats.faults_avoided, __ATOMIC_RELAXED);
+}
+
+/* Fills 'result' with the counters of the engine. Each counter is
+   read atomically, but they are not read all at once, so they may be
+   slightly inconsistent with each other while copies are performed.
+ */
+void delay_memcpy_get_stats(delay_memcpy_stats_t *result) {
+
+  unsigned long *from = (unsigned long *) &stats;
+  unsigned long *to = (unsigned long *) result;
+  size_t i;
+
+  for (i = 0; i < sizeof(stats) / sizeof(*from); i++)
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+/* Sets all the counters of the engine back to zero, except the number
+   of pending copies. The peak becomes the current number.
+ */
+void delay_memcpy_reset_stats(void) {
+
+  unsigned long *counters = (unsigned long *) &stats;
+  size_t i;
+
+  engine_lock();
+  for (i = 0; i < sizeof(stats) / sizeof(*counters); i++)
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  update_pending_stats();
+  engine_unlock();
+}
+
+/* Starts recording the faults, and the copies, syncs, cancels and
+   flushes requested, in a ring buffer of 'events' events, or
+   DEFAULT_TRACE_EVENTS if 0, that keeps the most recent ones. Any
+   trace recorded so far is dropped. The trace is meant to be written
+   out with delay_memcpy_dump_trace and replayed offline, with
+   delaymemcpy-replay. Copies performed right away while nothing is
+   pending are recorded as requested, and lazy fills and file reads
+   are not recorded. Can also be started by setting the
+   DELAY_MEMCPY_TRACE environment variable to the number of events.
+   Returns 0 on success, or -1 if the buffer cannot be allocated.
+ */
+int delay_memcpy_start_trace(size_t events) {
+
+  delay_memcpy_trace_event_t *buffer, *old_buffer;
+  size_t old_capacity;
+
+  if (events == 0)
+    events = DEFAULT_TRACE_EVENTS;
+  buffer = mmap(NULL, events * sizeof(*buffer), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED)
+    return -1;
+
+  engine_lock();
+  old_buffer = trace_events;
+  old_capacity = trace_capacity;
+  trace_events = buffer;
+  trace_recorded = 0;
+  __atomic_store_n(&trace_capacity, events, __ATOMIC_RELAXED);
+  engine_unlock();
+
+  if (old_buffer)
+    munmap(old_buffer, old_capacity * sizeof(*old_buffer));
+  return 0;
+}
+
+/* Stops recording the fault trace, and drops what was recorded. */
+void delay_memcpy_stop_trace(void) {
+
+  delay_memcpy_trace_event_t *buffer;
+  size_t capacity;
+
+  engine_lock();
+  buffer = trace_events;
+  capacity = trace_capacity;
+  trace_events = NULL;
+  __atomic_store_n(&trace_capacity, 0, __ATOMIC_RELAXED);
+  engine_unlock();
+
+  if (buffer)
+    munmap(buffer, capacity * sizeof(*buffer));
+}
+
+/* Writes 'size' bytes from 'data' to file 'fd', retrying after
+   partial writes. Returns 0 on success, or -1 on failure.
+ */
+static int write_fully(int fd, const void *data, size_t size) {
+
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/* Writes the fault trace recorded so far to file 'fd': a
+   delay_memcpy_trace_header_t, then the events, oldest first (see
+   delay_memcpy_start_trace). Recording goes on afterwards. Returns
+   the number of events written, or -1 with errno set on failure, or
+   if the trace is off.
+ */
+ssize_t delay_memcpy_dump_trace(int fd) {
+
+  delay_memcpy_trace_header_t header;
+  size_t count, first;
+  ssize_t result = -1;
+
+  engine_lock();
+
+  if (!trace_capacity) {
+    engine_unlock();
+    errno = EINVAL;
+    return -1;
+  }
+
+  count = trace_recorded < trace_capacity ? trace_recorded : trace_capacity;
+  first = trace_recorded % trace_capacity;
+  if (count < trace_capacity)
+    first = 0;
+
+  memcpy(header.magic, DELAY_MEMCPY_TRACE_MAGIC, sizeof(header.magic));
+  header.granularity = page_size;
+  header.events = count;
+  header.dropped = trace_recorded - count;
+
+  if (write_fully(fd, &header, sizeof(header)) == 0 &&
+      write_fully(fd, &trace_events[first], (count - first) * sizeof(*trace_events)) == 0 &&
+      write_fully(fd, trace_events, first * sizeof(*trace_events)) == 0)
+    result = count;
+
+  engine_unlock();
+  return result;
+}
+
+/* Sets the size, in bytes, from which copies are performed with
+   non-temporal stores, which bypass the cache: flushing a large copy
+   then does not evict the data the program is working on. Smaller
+   copies use memcpy. Pass SIZE_MAX to never use them.
+ */
+void delay_memcpy_set_streaming_threshold(size_t size) {
+
+  streaming_threshold = size;
+}
+
+/* Returns the size from which copies are performed with non-temporal
+   stores.
+ */
+size_t delay_memcpy_get_streaming_threshold(void) {
+
+  return streaming_threshold;
+}
+
+/* Enables or disables looking for source pages that are all zeros
+   when performing copies: if 'enabled' is TRUE (non-zero), destination
+   pages whose source is all zeros are dropped, so that they read as
+   zeros again, rather than copied to, which saves both the copy and
+   the memory. With the userfaultfd backend, they get the shared zero
+   page instead. This costs a check of each source page, so it is
+   disabled by default. Only private anonymous destinations are
+   dropped; copies that may run alongside other threads (see
+   delay_memcpy_start_drain) are performed as usual.
+ */
+void delay_memcpy_set_zero_pages(int enabled) {
+
+  zero_pages = enabled != 0;
+}
+
+/* Returns TRUE (non-zero) if source pages that are all zeros are
+   looked for when performing copies. */
+int delay_memcpy_get_zero_pages(void) {
+
+  return zero_pages;
+}
+
+/* Copies 'size' bytes from 'src' to 'dst' right away, with the same
+   copy kernel as the copies performed by the engine. Neither range
+   may be involved in a pending copy.
+ */
+void *delay_memcpy_copy_now(void *dst, void *src, size_t size) {
 
-  struct sigaction sa;
-  sa.sa_sigaction = delay_memcpy_segv_handler;
-  sa.sa_flags = SA_SIGINFO;
-  sigemptyset(&sa.sa_mask);
-  sigaction(SIGSEGV, &sa, NULL);
+  copy_bytes(dst, src, size);
+  return dst;
+}
+
+/* Performs the first page of the oldest pending copy to be drained,
+   if any. Like a fault handler, the page is taken out of the copy and
+   written outside of the engine whenever possible, so that the thread
+   does not hold the engine while copying at its idle priority.
+   Returns roughly the number of bytes copied.
+ */
+static size_t drain_one_page(void) {
+
+  in_flight_range_t *flight = NULL;
+  pending_copy_t *copy;
+  size_t first, last, size = 0;
 
-  page_size = sysconf(_SC_PAGESIZE);
+  engine_lock_for_fault();
+  copy = first_drained_copy;
+  if (copy) {
+    pending_range_bounds(copy, copy->dst, 1, 0, &first, &last);
+    size = last - first;
+    if (!begin_in_flight_range(copy, first, size, &flight))
+      materialize_pending_copy(copy, first, size);
+  }
+  engine_unlock();
+
+  if (flight) {
+    perform_in_flight_range(flight);
+    engine_lock_for_fault();
+    end_in_flight_range(flight);
+    engine_unlock();
+  }
+  return size;
 }
 
-/* Starts the copying process of 'size' bytes from 'src' to 'dst'. The
-   actual copy of data is performed in the signal handler for
-   segmentation fault. This function only stores the information
-   related to the copy in the internal data structure, and protects
-   the pages (source as read-only, destination as no access) so that
-   the signal handler is invoked when the copied data is needed. If
-   the maximum number of pending copies is reached, a copy is
-   performed immediately. Returns the value of dst.
+/* Body of the background drain thread. Performs the pending copies to
+   be drained page by page, oldest first, sleeping as needed to stay
+   within drain_rate bytes per second, and waits for new copies when
+   there are none left.
  */
-void *delay_memcpy(void *dst, void *src, size_t size) {
+static void *drain_thread_main(void *arg) {
 
-  
-  void* first_source_page = page_start(src);
-  void* last_soruce_page = page_start(src+size-1);
+  pthread_mutex_lock(&drain_mutex);
+  while (drain_state != DRAIN_STOPPED) {
 
-  void* first_dest_page = page_start(dst);
-  void* last_dest_page = page_start(dst+size-1);
+    if (drain_state == DRAIN_PAUSED ||
+	!__atomic_load_n(&drained_copies, __ATOMIC_RELAXED)) {
+      pthread_cond_wait(&drain_cond, &drain_mutex);
+      continue;
+    }
 
-  char* it = first_source_page;
-  volatile char read_char;  // prevent the unused read_char from being optimized out
+    size_t rate = drain_rate;
+    pthread_mutex_unlock(&drain_mutex);
 
-  while(it <= last_soruce_page )
-    {
-      // read from each source page to trigger an actual_copy if it needs it
-      read_char = *it;
+    size_t size = drain_one_page();
+    if (rate && size) {
+      unsigned long long nsec = size * 1000000000ULL / rate;
+      struct timespec delay = { nsec / 1000000000, nsec % 1000000000 };
+      nanosleep(&delay, NULL);
+    }
+
+    pthread_mutex_lock(&drain_mutex);
+  }
+  pthread_mutex_unlock(&drain_mutex);
+
+  return NULL;
+}
+
+/* Wakes up the background drain thread, if it is waiting for new
+   pending copies.
+ */
+static void wake_drain_thread(void) {
+
+  if (__atomic_load_n(&drain_state, __ATOMIC_RELAXED) != DRAIN_RUNNING)
+    return;
+
+  pthread_mutex_lock(&drain_mutex);
+  pthread_cond_signal(&drain_cond);
+  pthread_mutex_unlock(&drain_mutex);
+}
+
+/* Starts a background thread that performs the pending copies
+   registered with DELAY_MEMCPY_DRAIN page by page, oldest first, so
+   that the data is usually in place by the time it is needed. The thread coordinates with the signal handler
+   through the engine, and writes the pages through /proc/self/mem so
+   they only become accessible once complete. From then on, the
+   signal handler does the same.
+
+   'bytes_per_second' limits the rate of the thread (0 for no limit),
+   and 'cpu' pins it to a CPU (-1 to let it run anywhere). The thread
+   runs with idle scheduling priority, so it only uses CPU time that
+   nothing else wants. Returns 0 on success, or -1 if the thread could
+   not be started or is already running.
+ */
+int delay_memcpy_start_drain(size_t bytes_per_second, int cpu) {
+
+  struct sched_param param = { 0 };
+  sigset_t all, old;
+  int error;
+
+  if (open_self_mem() < 0)
+    return -1;
+
+  pthread_mutex_lock(&drain_mutex);
+  if (drain_state != DRAIN_STOPPED) {
+    pthread_mutex_unlock(&drain_mutex);
+    return -1;
+  }
+
+  engine_lock();
+  forced_copies = 1;
+  engine_unlock();
+
+  drain_rate = bytes_per_second;
+  drain_state = DRAIN_RUNNING;
+
+  // The thread must not run any signal handler of the process
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  error = pthread_create(&drain_thread, NULL, drain_thread_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (error) {
+    drain_state = DRAIN_STOPPED;
+    engine_lock();
+    if (!contexts_created)
+      forced_copies = 0;
+    engine_unlock();
+    pthread_mutex_unlock(&drain_mutex);
+    return -1;
+  }
+
+  pthread_setschedparam(drain_thread, SCHED_IDLE, &param);
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(drain_thread, sizeof(set), &set);
+  }
+
+  pthread_mutex_unlock(&drain_mutex);
+  return 0;
+}
+
+/* Stops the background drain thread and waits for it to finish. The
+   copies it did not perform remain pending. Unless a context was
+   created, copies are no longer forced from then on.
+ */
+void delay_memcpy_stop_drain(void) {
+
+  pthread_mutex_lock(&drain_mutex);
+  if (drain_state == DRAIN_STOPPED) {
+    pthread_mutex_unlock(&drain_mutex);
+    return;
+  }
+  drain_state = DRAIN_STOPPED;
+  pthread_cond_signal(&drain_cond);
+  pthread_mutex_unlock(&drain_mutex);
+
+  pthread_join(drain_thread, NULL);
+
+  engine_lock();
+  if (!contexts_created)
+    forced_copies = 0;
+  engine_unlock();
+}
+
+/* Pauses the background drain thread, for instance around latency
+   sensitive work. It does not hold the engine while paused.
+ */
+void delay_memcpy_pause_drain(void) {
+
+  pthread_mutex_lock(&drain_mutex);
+  if (drain_state == DRAIN_RUNNING)
+    drain_state = DRAIN_PAUSED;
+  pthread_mutex_unlock(&drain_mutex);
+}
+
+/* Resumes the background drain thread after delay_memcpy_pause_drain. */
+void delay_memcpy_resume_drain(void) {
+
+  pthread_mutex_lock(&drain_mutex);
+  if (drain_state == DRAIN_PAUSED) {
+    drain_state = DRAIN_RUNNING;
+    pthread_cond_signal(&drain_cond);
+  }
+  pthread_mutex_unlock(&drain_mutex);
+}
+
+/* Changes the rate limit of the background drain thread, in bytes per
+   second (0 for no limit).
+ */
+void delay_memcpy_set_drain_rate(size_t bytes_per_second) {
+
+  pthread_mutex_lock(&drain_mutex);
+  drain_rate = bytes_per_second;
+  pthread_mutex_unlock(&drain_mutex);
+}
+
+/* Search state for find_fanout_partner. */
+typedef struct fanout_query {
+  pending_copy_t *copy;
+  pending_copy_t *newest;
+} fanout_query_t;
+
+static void find_fanout_partner_visit(page_index_entry_t *entry, void *arg) {
+
+  fanout_query_t *query = arg;
+  pending_copy_t *copy = entry->copy;
+
+  if (!entry->is_dst && copy != query->copy && copy->kind == PENDING_COPY_PROTECTED &&
+      copy->src == query->copy->src && copy->size == query->copy->size &&
+      (!query->newest || copy->seq > query->newest->seq))
+    query->newest = copy;
+}
+
+/* Returns the most recent pending copy, other than 'copy', with a
+   protected destination and the same source and size as 'copy', or
+   NULL if there is none.
+ */
+static pending_copy_t *find_fanout_partner(pending_copy_t *copy) {
+
+  fanout_query_t query = { copy, NULL };
+  uintptr_t page = page_number(copy->src);
+
+  page_index_visit(page, page, find_fanout_partner_visit, &query);
+  return query.newest;
+}
+
+/* Registers a pending copy whose source is not the pending
+   destination of another copy. The copy is performed right away if it
+   cannot be kept pending. A copy of the same source and size as a
+   pending one joins its fan-out ring, and leaves alone the source
+   pages, which that one keeps read-only already.
+ */
+static void register_copy(void *dst, void *src, size_t size) {
+
+  pending_copy_t *copy, *partner;
+
+  reserve_pending_copies();
+
+  // perform any pending copy to the source pages, so they can be made read-only
+  resolve_pending_destinations(src, size);
+
+  if ((remap_buffers && delay_memcpy_remapped(dst, src, size) == 0) ||
+      (backend == DELAY_MEMCPY_BACKEND_USERFAULTFD &&
+       delay_memcpy_missing(dst, src, size) == 0))
+    return;
+
+  copy = add_pending_copy( dst, src, size, NULL, PENDING_COPY_PROTECTED );
+  if (!copy) {
+    copy_now(dst, src, size);
+    return;
+  }
+
+  partner = find_fanout_partner(copy);
+  if (partner) {
+    fanout_link(copy, partner);
+    STAT_ADD(copies_fanned_out, 1);
+  }
+
+  // one call per range, regardless of its size
+  if (!partner)
+    protect_new_copy( src, size, PROT_READ );
+  protect_new_copy( dst, size, PROT_NONE );
+}
+
+/* Registers a pending fill of 'size' bytes at 'dst' with byte 'c'. The
+   fill is performed right away if it cannot be kept pending.
+ */
+static void add_fill(void *dst, int c, size_t size) {
+
+  pending_copy_t *copy = add_pending_copy(dst, NULL, size, NULL, PENDING_COPY_FILL);
+
+  if (!copy) {
+    resolve_older_copies(dst, size, last_copy_seq + 1);
+    actual_fill(dst, c, size);
+    return;
+  }
+  copy->operand = c;
+  protect_new_copy(dst, size, PROT_NONE);
+}
+
+/* Registers a fill of 'size' bytes at 'dst' with byte 'c'. Zeros over
+   whole system pages are not kept pending: the pages are dropped right
+   away, once the pending copies reading them are performed, so that
+   they read as zeros again without being written (see
+   drop_zero_pages). Any other pages, and the rest of the range, are
+   filled lazily.
+ */
+static void register_fill(void *dst, int c, size_t size) {
 
-      mprotect_full_page( it, page_size, PROT_READ );
-      it += page_size;
+  void *first = (void *) (((uintptr_t) dst + system_page_size - 1) & -system_page_size);
+  void *last = (void *) (((uintptr_t) dst + size) & -system_page_size);
+
+  reserve_pending_copies();
+
+  c &= 0xff;
+  if (c == 0 && first < last && uffd < 0 && is_private_anonymous(first, last - first)) {
+    resolve_older_copies(first, last - first, last_copy_seq + 1);
+    if (drop_zero_pages(first, last - first)) {
+      if (first > dst)
+	add_fill(dst, c, first - dst);
+      if (last < dst + size)
+	add_fill(last, c, dst + size - last);
+      return;
     }
+  }
+
+  add_fill(dst, c, size);
+}
 
+/* Search state for has_newer_destination. */
+typedef struct newer_destination_query {
+  void *start;
+  void *end;
+  unsigned long seq;
+  int found;
+} newer_destination_query_t;
 
-  it = first_dest_page;
-  while(it <= last_dest_page )
-    {
-      mprotect_full_page( it, page_size, PROT_NONE );
-//      printf("Protecting %x\n", it);
-      it += page_size;
+static void has_newer_destination_visit(page_index_entry_t *entry, void *arg) {
+
+  newer_destination_query_t *query = arg;
+  pending_copy_t *copy = entry->copy;
+
+  if (entry->is_dst && copy->dst < query->end && copy->dst + copy->size > query->start &&
+      copy->seq > query->seq)
+    query->found = 1;
+}
+
+/* Returns TRUE (non-zero) if a pending copy requested after sequence
+   number 'seq' writes to any byte of the range from 'start' to
+   'start+size-1'.
+ */
+static int has_newer_destination(void *start, size_t size, unsigned long seq) {
+
+  newer_destination_query_t query = { start, start + size, seq, 0 };
+
+  page_index_visit(page_number(start), page_number(start + size - 1),
+		   has_newer_destination_visit, &query);
+  return query.found;
+}
+
+/* Registers a copy from 'src' to 'dst'. The parts of the source that
+   are still the pending destination of an older copy are not
+   performed first: the new copy is recorded against the source of
+   the most recent of those copies instead, which holds the very same
+   data as long as no newer copy writes to it. A chain A -> B -> C therefore becomes
+   A -> B and A -> C, and B is never filled unless it is touched. The
+   other parts are registered as usual.
+ */
+static void register_chained_copy(void *dst, void *src, size_t size) {
+
+  while (size > 0) {
+
+    pending_copy_t *copy = find_pending_destination(src, size, 1);
+    if (!copy) {
+      register_copy(dst, src, size);
+      return;
+    }
+
+    void *start = src > copy->dst ? src : copy->dst;
+    void *end = src + size < copy->dst + copy->size ? src + size : copy->dst + copy->size;
+    void *origin = copy->src + (start - copy->dst);
+    void *target = dst + (start - src);
+
+    // a fill is recorded as such, and the source of any other older
+    // copy may be where this one writes, or a file
+    if (copy->kind == PENDING_COPY_FILL) {
+      STAT_ADD(copies_forwarded, 1);
+      register_fill(target, copy->operand, end - start);
+    }
+    else if (copy->kind == PENDING_COPY_FILE ||
+	(origin < target + (end - start) && target < origin + (end - start)) ||
+	has_newer_destination(origin, end - start, copy->seq))
+      register_copy(target, start, end - start);
+    else {
+      STAT_ADD(copies_forwarded, 1);
+      register_copy(target, origin, end - start);
+    }
+
+    if (start > src)
+      register_chained_copy(dst, src, start - src);
+
+    dst += end - src;
+    size -= end - src;
+    src = end;
+  }
+}
+
+/* Search state for has_pending_copy. */
+typedef struct pending_query {
+  void *start;
+  void *end;
+  int found;
+} pending_query_t;
+
+static void has_pending_copy_visit(page_index_entry_t *entry, void *arg) {
+
+  pending_query_t *query = arg;
+  pending_copy_t *copy = entry->copy;
+  void *start = entry->is_dst ? copy->dst : copy->src;
+
+  if (page_start(start) < query->end && page_start(start + copy->size - 1) + page_size > query->start)
+    query->found = 1;
+}
+
+/* Returns TRUE (non-zero) if a pending copy, from or to, involves any
+   of the pages of the range from 'start' to 'start+size-1'.
+ */
+static int has_pending_copy(void *start, size_t size) {
+
+  pending_query_t query = { page_start(start), page_start(start + size - 1) + page_size, 0 };
+
+  page_index_visit(page_number(start), page_number(start + size - 1),
+		   has_pending_copy_visit, &query);
+  return query.found;
+}
+
+/* Measures the costs used by choose_copy_mode on this machine: a copy
+   of CALIBRATION_SIZE bytes with memcpy, the same copy kept pending,
+   and its pages then touched in reverse order, so that each takes a
+   fault of its own. The best of a few rounds is kept. Statistics are
+   reset afterwards.
+ */
+static void calibrate_cost_model(void) {
+
+  size_t size = (CALIBRATION_SIZE + page_size - 1) & -page_size;
+  uint64_t copy_time = UINT64_MAX, register_time = UINT64_MAX, fault_time = UINT64_MAX;
+  void *area, *src, *dst, *page;
+  int round;
+
+  area = mmap(NULL, 2 * size + page_size, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED)
+    return;
+  src = page_start(area + page_size - 1);
+  dst = src + size;
+  memset(src, 1, 2 * size);
+
+  for (round = 0; round < 3; round++) {
+
+    uint64_t start = monotonic_time();
+    copy_bytes(dst, src, size);
+    uint64_t time = monotonic_time() - start;
+    if (time < copy_time)
+      copy_time = time;
+
+    start = monotonic_time();
+    delay_memcpy_flags(dst, src, size, DELAY_MEMCPY_LAZY);
+    time = monotonic_time() - start;
+    if (time < register_time)
+      register_time = time;
+
+    start = monotonic_time();
+    for (page = dst + size - page_size; page >= dst; page -= page_size)
+      (void) *(volatile char *) page;
+    time = monotonic_time() - start;
+    if (time < fault_time)
+      fault_time = time;
+  }
+
+  delay_memcpy_cancel(dst, size);
+  munmap(area, 2 * size + page_size);
+
+  __atomic_store_n(&copy_ps_per_byte, copy_time * 1000 / size + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&register_ns, register_time, __ATOMIC_RELAXED);
+  __atomic_store_n(&fault_ps_per_byte, fault_time * 1000 / size + 1, __ATOMIC_RELAXED);
+
+  engine_lock();
+  touch_registered = touch_performed = 0;
+  engine_unlock();
+  delay_memcpy_reset_stats();
+}
+
+/* Chooses how to perform an automatic copy of 'size' bytes to 'dst'
+   (see delay_memcpy_flags). Copying right away costs 'size' times the
+   copy cost per byte; keeping the copy pending costs its registration,
+   plus the fault cost per byte for the fraction of the bytes expected
+   to be touched, as observed on the previous pending copies. Until
+   TOUCH_RATIO_WINDOW bytes were observed, DEFAULT_TOUCH_RATIO stands
+   in for the bytes not observed yet. The cheaper is chosen.
+
+   A copy that covers no whole page of the destination, or that costs
+   no more than registering it and taking a single fault, is always
+   performed right away, as keeping it pending cannot be much cheaper
+   but can be much slower. Copies expected to be mostly touched are
+   handed to the background drain thread, when it runs. Every
+   EXPLORE_INTERVAL copies performed right away that would have been
+   cheaper if untouched, one is kept pending anyway, so that a change
+   in the access pattern is noticed, as long as that copy costs no more
+   than the EXPLORE_INTERVAL copies before it even if entirely touched.
+ */
+static int choose_copy_mode(void *dst, size_t size) {
+
+  uint64_t registered = __atomic_load_n(&touch_registered, __ATOMIC_RELAXED);
+  uint64_t performed = __atomic_load_n(&touch_performed, __ATOMIC_RELAXED);
+  uint64_t fault_cost = __atomic_load_n(&fault_ps_per_byte, __ATOMIC_RELAXED);
+  uint64_t eager_cost, lazy_cost, setup_cost, ratio;
+
+  if (page_start(dst + page_size - 1) + page_size > dst + size)
+    return DELAY_MEMCPY_EAGER;
+
+  setup_cost = __atomic_load_n(&register_ns, __ATOMIC_RELAXED);
+  eager_cost = size * __atomic_load_n(&copy_ps_per_byte, __ATOMIC_RELAXED) / 1000;
+  if (eager_cost <= setup_cost + page_size * fault_cost / 1000)
+    return DELAY_MEMCPY_EAGER;
+
+  if (performed > registered)
+    performed = registered;
+  if (registered >= TOUCH_RATIO_WINDOW)
+    ratio = performed * 1000 / registered;
+  else
+    ratio = (performed * 1000 + (TOUCH_RATIO_WINDOW - registered) * DEFAULT_TOUCH_RATIO) /
+      TOUCH_RATIO_WINDOW;
+  lazy_cost = setup_cost + size * ratio / 1000 * fault_cost / 1000;
+
+  if (lazy_cost >= eager_cost) {
+    if (setup_cost + size * fault_cost / 1000 > EXPLORE_INTERVAL * eager_cost ||
+	__atomic_add_fetch(&eager_streak, 1, __ATOMIC_RELAXED) < EXPLORE_INTERVAL)
+      return DELAY_MEMCPY_EAGER;
+    __atomic_store_n(&eager_streak, 0, __ATOMIC_RELAXED);
+  }
+
+  if (ratio >= DRAIN_MIN_TOUCH_RATIO &&
+      __atomic_load_n(&drain_state, __ATOMIC_RELAXED) == DRAIN_RUNNING)
+    return DELAY_MEMCPY_DRAIN;
+  return DELAY_MEMCPY_LAZY;
+}
+
+/* Performs a copy right away, after dropping the pending copies to
+   the same bytes, and performing those involving the same pages.
+   Called with the engine.
+ */
+static void copy_eagerly(void *dst, void *src, size_t size) {
+
+  discard_pending_destinations(dst, size);
+  if (has_pending_copy(src, size) || has_pending_copy(dst, size))
+    copy_now(dst, src, size);
+  else
+    copy_bytes(dst, src, size);
+}
+
+/* Registers a pending copy in 'context', handed to the drain thread
+   if 'flags' is DELAY_MEMCPY_DRAIN. Called with the engine.
+ */
+static void register_lazy_copy(delay_memcpy_context_t *context, void *dst, void *src,
+			       size_t size, int flags) {
+
+  // older copies to the same bytes would only be overwritten
+  discard_pending_destinations(dst, size);
+  new_copies_drained = flags == DELAY_MEMCPY_DRAIN;
+  new_copies_context = context;
+  register_chained_copy(dst, src, size);
+  new_copies_drained = 0;
+  new_copies_context = NULL;
+}
+
+/* Copies 'size' bytes from 'src' to 'dst' the way given by 'flags'
+   (see delay_memcpy_flags), registering any pending copy in
+   'context'. Returns the value of dst.
+ */
+static void *copy_in_context(delay_memcpy_context_t *context, void *dst, void *src,
+			     size_t size, int flags) {
+
+  if (size == 0)
+    return dst;
+
+  if (__atomic_load_n(&trace_capacity, __ATOMIC_RELAXED)) {
+    engine_lock();
+    trace_event(DELAY_MEMCPY_TRACE_COPY, flags, NULL, dst, src, size, 0, monotonic_time());
+    engine_unlock();
+  }
+
+  if (flags == DELAY_MEMCPY_AUTO)
+    flags = choose_copy_mode(dst, size);
+
+  if (flags == DELAY_MEMCPY_EAGER) {
+    STAT_ADD(copies_eager, 1);
+    // nothing pending means nothing to protect or resolve
+    if (!__atomic_load_n(&first_pending_copy, __ATOMIC_ACQUIRE)) {
+      copy_bytes(dst, src, size);
+      return dst;
+    }
+    engine_lock();
+    copy_eagerly(dst, src, size);
+    engine_unlock();
+    return dst;
+  }
+
+  engine_lock();
+  register_lazy_copy(context, dst, src, size, flags);
+  engine_unlock();
+
+  wake_drain_thread();
+  return dst;
+}
+
+/* Copies 'size' bytes from 'src' to 'dst', the way given by 'flags':
+
+   - DELAY_MEMCPY_EAGER: the copy is performed right away. Pending
+     copies to the destination are dropped, and pending copies
+     involving the source are performed first.
+   - DELAY_MEMCPY_LAZY: the copy is kept pending until its pages are
+     touched. This function only stores the information related to the
+     copy in the internal data structure, and protects the pages
+     (source as read-only, destination as no access) so that the
+     signal handler is invoked when the copied data is needed. If the
+     maximum number of pending copies is reached, a copy is performed
+     immediately.
+   - DELAY_MEMCPY_DRAIN: the copy is kept pending, and performed by
+     the background drain thread, if started, as soon as it can.
+     Copies registered otherwise are left to the faults.
+   - DELAY_MEMCPY_AUTO: one of the above, chosen from the size of the
+     copy and the costs observed so far (see choose_copy_mode).
+
+   Returns the value of dst.
+ */
+void *delay_memcpy_flags(void *dst, void *src, size_t size, int flags) {
+
+  return copy_in_context(NULL, dst, src, size, flags);
+}
+
+/* Copies 'size' bytes from 'src' to 'dst', either right away or
+   lazily, whichever is expected to be cheaper (see
+   delay_memcpy_flags). Returns the value of dst.
+ */
+void *delay_memcpy(void *dst, void *src, size_t size) {
+
+  return delay_memcpy_flags(dst, src, size, DELAY_MEMCPY_AUTO);
+}
+
+/* Performs the 'count' copies of 'vec', in order, each the way given
+   by 'flags' (see delay_memcpy_flags), as if by as many calls to
+   delay_memcpy_flags. The copies are registered under a single lock
+   of the engine, without touching the protection of any page, and
+   only then are the pages that the new pending copies would have
+   protected, which forwarded copies may have moved away from the
+   ranges of 'vec', protected according to the page index: the ranges
+   are sorted and merged, so that each run of pages takes as many
+   calls to mprotect as it has changes of protection, however many
+   copies share it.
+ */
+void delay_memcpy_v(const delay_memcpy_vec_t *vec, size_t count, int flags) {
+
+  size_t i, runs;
+  int registered = 0;
+
+  engine_lock();
+  protection_deferred = 1;
+  deferred_count = 0;
+
+  for (i = 0; i < count; i++) {
+
+    int mode = flags;
+
+    if (vec[i].size == 0)
+      continue;
+    trace_event(DELAY_MEMCPY_TRACE_COPY, flags, NULL, vec[i].dst, vec[i].src, vec[i].size,
+		0, trace_capacity ? monotonic_time() : 0);
+
+    if (mode == DELAY_MEMCPY_AUTO)
+      mode = choose_copy_mode(vec[i].dst, vec[i].size);
+
+    if (mode == DELAY_MEMCPY_EAGER) {
+      STAT_ADD(copies_eager, 1);
+      copy_eagerly(vec[i].dst, vec[i].src, vec[i].size);
+      continue;
     }
 
-  add_pending_copy( dst, src, size, NULL );
+    register_lazy_copy(NULL, vec[i].dst, vec[i].src, vec[i].size, mode);
+    registered = 1;
+  }
+
+  // copies registered later in the batch may have performed or split
+  // earlier ones, so the protection comes from what is left pending
+  protection_deferred = 0;
+  runs = merge_page_ranges(deferred_ranges, deferred_count);
+  for (i = 0; i < runs; i++)
+    refresh_protection((void *) (deferred_ranges[i].first << page_shift),
+		       (deferred_ranges[i].last + 1 - deferred_ranges[i].first) << page_shift);
+
+  engine_unlock();
+
+  if (registered)
+    wake_drain_thread();
+}
+
+/* Creates a context in which copies can be registered, by one thread
+   or one part of the program, and performed together (see
+   delay_memcpy_flush_context). Copies registered in the context with
+   delay_memcpy_in_context are performed the way given by 'flags' (see
+   delay_memcpy_flags).
+
+   The engine itself is shared by all contexts and safe to use from
+   any thread once a context exists: from then on, copies are written
+   through /proc/self/mem, so no thread ever sees a page before it is
+   complete, and faults on unrelated copies are performed in parallel.
+   Programs with several threads must create a context before a
+   second thread touches memory involved in pending copies. Returns
+   the context, or NULL on failure.
+ */
+delay_memcpy_context_t *delay_memcpy_create_context(int flags) {
+
+  delay_memcpy_context_t *context = malloc(sizeof(*context));
+  int error;
+
+  if (!context)
+    return NULL;
+  context->flags = flags;
+
+  engine_lock();
+  error = open_self_mem();
+  if (!error)
+    forced_copies = contexts_created = 1;
+  engine_unlock();
+
+  if (error) {
+    free(context);
+    return NULL;
+  }
+  return context;
+}
+
+/* Performs every pending copy registered in a context, in the order
+   of the list, together with the older copies they depend on. Copies
+   registered in other contexts otherwise remain pending.
+ */
+void delay_memcpy_flush_context(delay_memcpy_context_t *context) {
+
+  pending_copy_t *copy;
+
+  engine_lock();
+  for (;;) {
+    for (copy = first_pending_copy; copy && copy->context != context; copy = copy->next);
+    if (!copy)
+      break;
+    materialize_pending_copy(copy, 0, copy->size);
+  }
+  engine_unlock();
+}
+
+/* Performs the pending copies of a context, then frees it. The engine
+   keeps forcing copies, as other threads may still run.
+ */
+void delay_memcpy_destroy_context(delay_memcpy_context_t *context) {
+
+  if (!context)
+    return;
+  delay_memcpy_flush_context(context);
+  free(context);
+}
+
+/* Copies 'size' bytes from 'src' to 'dst' the way given by the flags
+   of 'context', and registers any pending copy in it. Returns the
+   value of dst.
+ */
+void *delay_memcpy_in_context(delay_memcpy_context_t *context, void *dst, void *src, size_t size) {
+
+  return copy_in_context(context, dst, src, size, context->flags);
+}
+
+/* Reads 'size' bytes at 'offset' in file 'fd' to 'dst' lazily, like a
+   pending copy: the destination is made inaccessible, and each part
+   is only read from the file (see actual_read_file) when touched,
+   synced or flushed. Only regular files are supported, and the size
+   is cut at the end of the file. The file descriptor must stay open
+   until the whole destination is filled. Each part holds what the
+   file held when it was filled: writes to the file, or truncating
+   it, after that do not change it, but those made before change it
+   like they would change a read made at that time.
+   Returns the number of bytes to be read, or -1 with errno set on
+   failure.
+ */
+ssize_t delay_read_fd(void *dst, int fd, off_t offset, size_t size) {
+
+  struct stat st;
+  pending_copy_t *copy;
+
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (!S_ISREG(st.st_mode) || offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (offset >= st.st_size)
+    return 0;
+  if (size > st.st_size - offset)
+    size = st.st_size - offset;
+  if (size == 0)
+    return 0;
+
+  engine_lock();
+
+  // older copies to the same bytes would only be overwritten
+  discard_pending_destinations(dst, size);
+  reserve_pending_copies();
+
+  copy = add_pending_copy(dst, (void *) (uintptr_t) offset, size, NULL, PENDING_COPY_FILE);
+  if (copy) {
+    copy->operand = fd;
+    mprotect_full_page(dst, size, PROT_NONE);
+  }
+  else {
+    resolve_older_copies(dst, size, last_copy_seq + 1);
+    actual_read_file(dst, fd, offset, size);
+  }
+
+  engine_unlock();
+  return size;
+}
+
+/* Fills 'size' bytes at 'dst' with byte 'c' lazily, like a pending
+   copy: the destination is made inaccessible, and each part is only
+   filled when touched, synced or flushed. Whole pages of private
+   anonymous memory filled with zeros are dropped right away instead,
+   which is about as cheap (see register_fill). Returns the value of
+   dst.
+ */
+void *delay_memset(void *dst, int c, size_t size) {
+
+  if (size == 0)
+    return dst;
+
+  engine_lock();
+
+  // older copies to the same bytes would only be overwritten
+  discard_pending_destinations(dst, size);
+  register_fill(dst, c, size);
 
+  engine_unlock();
   return dst;
 }
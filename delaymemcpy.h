@@ -2,9 +2,180 @@
 #define _DELAYMEMCPY_H_
 
 #include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DELAY_MEMCPY_BACKEND_SIGSEGV 0
+#define DELAY_MEMCPY_BACKEND_USERFAULTFD 1
+
+/* How delay_memcpy_flags performs a copy */
+#define DELAY_MEMCPY_AUTO 0
+#define DELAY_MEMCPY_EAGER 1
+#define DELAY_MEMCPY_LAZY 2
+#define DELAY_MEMCPY_DRAIN 3
+
+/* Number of buckets of the fault latency histogram. Bucket i counts
+   the faults that took from 2^i to 2^(i+1)-1 nanoseconds to handle. */
+#define DELAY_MEMCPY_LATENCY_BUCKETS 32
+
+/* Kinds of events of the fault trace (see delay_memcpy_start_trace) */
+#define DELAY_MEMCPY_TRACE_COPY 0
+#define DELAY_MEMCPY_TRACE_FAULT 1
+#define DELAY_MEMCPY_TRACE_SYNC 2
+#define DELAY_MEMCPY_TRACE_CANCEL 3
+#define DELAY_MEMCPY_TRACE_FLUSH 4
+
+/* Flag of the fault events caused by a write */
+#define DELAY_MEMCPY_TRACE_WRITE 1
+
+/* Event of the fault trace. For a copy, 'dst', 'src' and 'size' are
+   those of the request, and 'flags' its DELAY_MEMCPY_* mode. For a
+   fault, 'addr' is the address that faulted, 'dst', 'src' and 'size'
+   describe the pending copy it hit, and 'bytes' is the number of
+   bytes performed to resolve it. For a sync or a cancel, 'dst' and
+   'size' are the range. 'time' is in nanoseconds of the monotonic
+   clock. */
+typedef struct delay_memcpy_trace_event {
+  uint64_t time;
+  uint32_t type;
+  uint32_t flags;
+  uint64_t addr;
+  uint64_t dst;
+  uint64_t src;
+  uint64_t size;
+  uint64_t bytes;
+} delay_memcpy_trace_event_t;
+
+/* Start of a trace written by delay_memcpy_dump_trace, followed by
+   'events' events, oldest first. 'dropped' events were overwritten
+   before the dump, and 'granularity' is the page size of the engine
+   (see delay_memcpy_set_granularity). */
+#define DELAY_MEMCPY_TRACE_MAGIC "DMCTRACE"
+typedef struct delay_memcpy_trace_header {
+  char magic[8];
+  uint64_t granularity;
+  uint64_t events;
+  uint64_t dropped;
+} delay_memcpy_trace_header_t;
+
+/* One copy of a batch (see delay_memcpy_v) */
+typedef struct delay_memcpy_vec {
+  void *dst;
+  void *src;
+  size_t size;
+} delay_memcpy_vec_t;
+
+/* Context in which copies are registered (see
+   delay_memcpy_create_context) */
+typedef struct delay_memcpy_context delay_memcpy_context_t;
+
+/* Counters of the lazy copy engine (see delay_memcpy_get_stats). */
+typedef struct delay_memcpy_stats {
+
+  unsigned long copies_registered;
+  unsigned long bytes_registered;
+
+  /* Copies performed right away rather than registered */
+  unsigned long copies_eager;
+
+  /* Copies whose source was the pending destination of another copy,
+     recorded against the source of that copy instead */
+  unsigned long copies_forwarded;
+
+  /* Copies of the same source and size as a pending copy, whose
+     source pages are then performed into every destination at once */
+  unsigned long copies_fanned_out;
+
+  /* Faults handled, by the kind of access that caused them */
+  unsigned long faults_src_read;
+  unsigned long faults_dst_read;
+  unsigned long faults_write;
+  unsigned long faults_avoided;
+
+  /* Bytes performed by the engine after being registered, and bytes
+     dropped while still pending */
+  unsigned long bytes_copied;
+  unsigned long bytes_never_copied;
+
+  /* System pages of destinations left to read as zeros, rather than
+     copied to, as their source was all zeros (see
+     delay_memcpy_set_zero_pages) */
+  unsigned long zero_pages_skipped;
+
+  /* Copies performed to make room for new ones, and pending copies
+     split in two */
+  unsigned long forced_evictions;
+  unsigned long splits;
+
+  unsigned long pending_copies;
+  unsigned long peak_pending_copies;
+
+  unsigned long fault_latency[DELAY_MEMCPY_LATENCY_BUCKETS];
+
+} delay_memcpy_stats_t;
 
 void initialize_delay_memcpy_data(void);
 void *delay_memcpy(void *dst, void *src, size_t size);
+void *delay_memcpy_flags(void *dst, void *src, size_t size, int flags);
+void delay_memcpy_v(const delay_memcpy_vec_t *vec, size_t count, int flags);
+
+delay_memcpy_context_t *delay_memcpy_create_context(int flags);
+void delay_memcpy_destroy_context(delay_memcpy_context_t *context);
+void *delay_memcpy_in_context(delay_memcpy_context_t *context, void *dst, void *src, size_t size);
+void delay_memcpy_flush_context(delay_memcpy_context_t *context);
+ssize_t delay_read_fd(void *dst, int fd, off_t offset, size_t size);
+void *delay_memset(void *dst, int c, size_t size);
 void reset_pending_copy_slots();
 
+void delay_memcpy_sync(void *ptr, size_t size);
+void delay_memcpy_flush_all(void);
+int delay_memcpy_set_flush_threads(unsigned int threads);
+unsigned int delay_memcpy_get_flush_threads(void);
+void delay_memcpy_cancel(void *dst, size_t size);
+
+int delay_memcpy_set_capacity(size_t capacity);
+size_t delay_memcpy_get_capacity(void);
+int delay_memcpy_reserve(size_t count);
+
+void *delay_memcpy_alloc(size_t size);
+void delay_memcpy_free(void *ptr);
+
+int delay_memcpy_set_fault_ahead(size_t min_bytes, size_t max_bytes);
+void delay_memcpy_get_fault_ahead(size_t *min_bytes, size_t *max_bytes);
+unsigned long delay_memcpy_get_faults_avoided(void);
+
+void delay_memcpy_get_stats(delay_memcpy_stats_t *stats);
+void delay_memcpy_reset_stats(void);
+
+int delay_memcpy_start_trace(size_t events);
+void delay_memcpy_stop_trace(void);
+ssize_t delay_memcpy_dump_trace(int fd);
+
+int delay_memcpy_set_granularity(size_t granularity);
+size_t delay_memcpy_get_granularity(void);
+size_t delay_memcpy_huge_page_size(void);
+
+void delay_memcpy_set_streaming_threshold(size_t size);
+size_t delay_memcpy_get_streaming_threshold(void);
+void delay_memcpy_set_zero_pages(int enabled);
+int delay_memcpy_get_zero_pages(void);
+void *delay_memcpy_copy_now(void *dst, void *src, size_t size);
+
+int delay_memcpy_set_backend(int backend);
+int delay_memcpy_get_backend(void);
+
+int delay_memcpy_start_drain(size_t bytes_per_second, int cpu);
+void delay_memcpy_stop_drain(void);
+void delay_memcpy_pause_drain(void);
+void delay_memcpy_resume_drain(void);
+void delay_memcpy_set_drain_rate(size_t bytes_per_second);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
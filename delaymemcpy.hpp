@@ -0,0 +1,286 @@
+#ifndef _DELAYMEMCPY_HPP_
+#define _DELAYMEMCPY_HPP_
+
+#include "delaymemcpy.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+/* C++ layer over the delay memcpy engine, header only. The engine is
+   started on first use, buffers own page aligned memory and drop the
+   copies still pending into them when they go away, and contexts are
+   flushed when destroyed. Errors are reported with exceptions.
+ */
+namespace delaymemcpy {
+
+/* Granularity of the types below that follows the one the engine uses
+   at run time (see delay_memcpy_set_granularity), rather than a
+   constant. */
+constexpr std::size_t runtime_granularity = 0;
+
+/* Starts the engine (see initialize_delay_memcpy_data), once, whichever
+   thread calls it first. */
+inline void initialize() {
+
+  static std::once_flag once;
+  std::call_once(once, initialize_delay_memcpy_data);
+}
+
+/* Page arithmetic for pages of 'Granularity' bytes, a power of two
+   known at compile time, so that it is only shifts and masks by
+   constants. It only serves the wrapper itself (the capacity, pages
+   and page syncs of a lazy_buffer): the engine does its own page
+   arithmetic with the granularity it uses at run time. */
+template <std::size_t Granularity>
+struct page_math {
+
+  static_assert(Granularity > 0 && (Granularity & (Granularity - 1)) == 0,
+		"the granularity must be a power of two");
+
+  static constexpr std::size_t size() { return Granularity; }
+
+  /* Start of the page containing 'address' */
+  static constexpr std::uintptr_t start(std::uintptr_t address) {
+    return address & ~(std::uintptr_t) (Granularity - 1);
+  }
+
+  /* 'bytes' rounded up to a whole number of pages */
+  static constexpr std::size_t round_up(std::size_t bytes) {
+    return (bytes + Granularity - 1) & ~(Granularity - 1);
+  }
+
+  /* Number of the page containing byte 'offset' of a page aligned range */
+  static constexpr std::size_t index(std::size_t offset) { return offset / Granularity; }
+
+  /* Checks that the engine uses this granularity, which the program
+     sets itself (see delay_memcpy_set_granularity), as it is shared
+     by every user of the engine. Throws std::invalid_argument if it
+     does not. */
+  static void check() {
+    initialize();
+    if (delay_memcpy_get_granularity() != Granularity)
+      throw std::invalid_argument("delaymemcpy: the engine uses another granularity");
+  }
+};
+
+/* Same, for the granularity of the engine at run time. */
+template <>
+struct page_math<runtime_granularity> {
+
+  static std::size_t size() { return delay_memcpy_get_granularity(); }
+
+  static std::uintptr_t start(std::uintptr_t address) {
+    return address & ~(std::uintptr_t) (size() - 1);
+  }
+
+  static std::size_t round_up(std::size_t bytes) {
+    return (bytes + size() - 1) & ~(size() - 1);
+  }
+
+  static std::size_t index(std::size_t offset) { return offset / size(); }
+
+  static void check() { initialize(); }
+};
+
+/* Owner of a context of the engine (see delay_memcpy_create_context).
+   The copies registered in it are performed when it is destroyed. */
+class context {
+
+public:
+
+  /* Creates a context whose copies are performed the way given by
+     'flags' (see delay_memcpy_flags). Throws std::runtime_error on
+     failure. */
+  explicit context(int flags = DELAY_MEMCPY_AUTO) {
+    initialize();
+    context_ = delay_memcpy_create_context(flags);
+    if (!context_)
+      throw std::runtime_error("delaymemcpy: cannot create a context");
+  }
+
+  context(context &&other) noexcept : context_(other.context_) { other.context_ = nullptr; }
+
+  context &operator=(context &&other) noexcept {
+    std::swap(context_, other.context_);
+    return *this;
+  }
+
+  context(const context &) = delete;
+  context &operator=(const context &) = delete;
+
+  ~context() { delay_memcpy_destroy_context(context_); }
+
+  /* Copies 'size' bytes from 'src' to 'dst' in the context (see
+     delay_memcpy_in_context). */
+  void *copy(void *dst, const void *src, std::size_t size) {
+    return delay_memcpy_in_context(context_, dst, const_cast<void *>(src), size);
+  }
+
+  /* Performs the copies pending in the context. */
+  void flush() { delay_memcpy_flush_context(context_); }
+
+  delay_memcpy_context_t *get() const noexcept { return context_; }
+
+private:
+
+  delay_memcpy_context_t *context_;
+};
+
+/* Buffer of 'size' elements of type 'T', that copies can fill lazily.
+   The memory is allocated with delay_memcpy_alloc, so it is aligned
+   to, and made of whole, pages of 'Granularity' bytes, which share no
+   page with anything else, and copies between such buffers may be
+   remapped rather than copied.
+
+   A buffer can be moved but not copied: moving it hands over the
+   memory itself, so the copies pending into it stay pending. When a
+   buffer is destroyed, the copies pending into it are dropped without
+   being performed, while those reading from it are performed first,
+   as their destinations still need the data.
+
+   A buffer with a fixed 'Granularity' can only be created while the
+   engine uses that granularity.
+ */
+template <typename T, std::size_t Granularity = runtime_granularity>
+class lazy_buffer {
+
+  static_assert(std::is_trivially_copyable<T>::value,
+		"lazy_buffer elements are copied as raw bytes");
+
+public:
+
+  typedef T value_type;
+  typedef page_math<Granularity> pages;
+
+  lazy_buffer() noexcept : data_(nullptr), size_(0), capacity_(0) {}
+
+  /* Allocates a buffer of 'size' elements, which read as zeros until
+     written. Throws std::bad_alloc on failure, or std::invalid_argument
+     if the engine uses another granularity. */
+  explicit lazy_buffer(std::size_t size) : data_(nullptr), size_(size), capacity_(0) {
+    pages::check();
+    if (size > 0) {
+      capacity_ = pages::round_up(size * sizeof(T));
+      data_ = static_cast<T *>(delay_memcpy_alloc(capacity_));
+      if (!data_)
+	throw std::bad_alloc();
+    }
+  }
+
+  lazy_buffer(lazy_buffer &&other) noexcept
+    : data_(other.data_), size_(other.size_), capacity_(other.capacity_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.capacity_ = 0;
+  }
+
+  lazy_buffer &operator=(lazy_buffer &&other) noexcept {
+    lazy_buffer(std::move(other)).swap(*this);
+    return *this;
+  }
+
+  lazy_buffer(const lazy_buffer &) = delete;
+  lazy_buffer &operator=(const lazy_buffer &) = delete;
+
+  ~lazy_buffer() {
+    if (data_) {
+      delay_memcpy_cancel(data_, capacity_);
+      delay_memcpy_free(data_);
+    }
+  }
+
+  void swap(lazy_buffer &other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+  }
+
+  T *data() noexcept { return data_; }
+  const T *data() const noexcept { return data_; }
+  std::size_t size() const noexcept { return size_; }
+  std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+  bool empty() const noexcept { return size_ == 0; }
+
+  /* Number of pages of the buffer */
+  std::size_t page_count() const { return capacity_ / pages::size(); }
+
+  T &operator[](std::size_t index) { return data_[index]; }
+  const T &operator[](std::size_t index) const { return data_[index]; }
+  T *begin() noexcept { return data_; }
+  T *end() noexcept { return data_ + size_; }
+  const T *begin() const noexcept { return data_; }
+  const T *end() const noexcept { return data_ + size_; }
+
+  /* Copies 'count' elements from 'src' to the buffer, from element
+     'offset' on, the way given by 'flags' (see delay_memcpy_flags).
+     Throws std::out_of_range if they do not all fit in the buffer. */
+  void copy_from(const T *src, std::size_t count, std::size_t offset = 0,
+		 int flags = DELAY_MEMCPY_AUTO) {
+    check_range(offset, count);
+    delay_memcpy_flags(data_ + offset, const_cast<T *>(src), count * sizeof(T), flags);
+  }
+
+  /* Copies as many elements as both buffers hold from 'src', the way
+     given by 'flags'. */
+  template <std::size_t OtherGranularity>
+  void copy_from(const lazy_buffer<T, OtherGranularity> &src, int flags = DELAY_MEMCPY_AUTO) {
+    copy_from(src.data(), src.size() < size_ ? src.size() : size_, 0, flags);
+  }
+
+  /* Same, registering any pending copy in context 'ctx'. */
+  void copy_from(context &ctx, const T *src, std::size_t count, std::size_t offset = 0) {
+    check_range(offset, count);
+    ctx.copy(data_ + offset, src, count * sizeof(T));
+  }
+
+  /* Performs the copies pending into the 'count' elements from element
+     'offset' on, or into the whole buffer. Throws std::out_of_range if
+     the elements are not all in the buffer. */
+  void sync(std::size_t offset, std::size_t count) {
+    check_range(offset, count);
+    delay_memcpy_sync(data_ + offset, count * sizeof(T));
+  }
+  void sync() { delay_memcpy_sync(data_, capacity_); }
+
+  /* Performs the copies pending into the page holding element 'index'
+     only. Throws std::out_of_range if there is no such element. */
+  void sync_page(std::size_t index) {
+    check_range(index, 1);
+    std::uintptr_t page = pages::start(reinterpret_cast<std::uintptr_t>(data_ + index));
+    delay_memcpy_sync(reinterpret_cast<void *>(page), pages::size());
+  }
+
+  /* Drops the copies pending into the buffer (see
+     delay_memcpy_cancel). The elements are unspecified until written:
+     they may hold their values from before those copies, or the
+     source's, and pages remapped from another lazy_buffer may keep
+     following the source until written. */
+  void cancel() { delay_memcpy_cancel(data_, capacity_); }
+
+private:
+
+  /* Throws std::out_of_range unless the 'count' elements from element
+     'offset' on are all in the buffer. */
+  void check_range(std::size_t offset, std::size_t count) const {
+    if (offset > size_ || count > size_ - offset)
+      throw std::out_of_range("delaymemcpy: range outside of the lazy_buffer");
+  }
+
+  T *data_;
+  std::size_t size_;
+  std::size_t capacity_;
+};
+
+template <typename T, std::size_t Granularity>
+inline void swap(lazy_buffer<T, Granularity> &a, lazy_buffer<T, Granularity> &b) noexcept {
+  a.swap(b);
+}
+
+}
+
+#endif
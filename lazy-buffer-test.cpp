@@ -0,0 +1,82 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "delaymemcpy.hpp"
+
+using delaymemcpy::lazy_buffer;
+
+#define SIZE 0x40000
+
+/* Exercises the C++ wrapper of delaymemcpy.hpp. Returns 1 as soon as
+   a check fails. */
+int main(void) {
+
+  delaymemcpy::initialize();
+  size_t granularity = delay_memcpy_get_granularity();
+
+  printf("\nCreating a buffer of another granularity than the engine's\n");
+  try {
+    if (granularity == 0x10000)
+      throw std::invalid_argument("same granularity");
+    lazy_buffer<char, 0x10000> wrong(SIZE);
+    printf("FAILED: created, and the granularity is now 0x%zx\n", delay_memcpy_get_granularity());
+    return 1;
+  }
+  catch (const std::invalid_argument &) {
+    printf("Refused, granularity still 0x%zx\n", delay_memcpy_get_granularity());
+  }
+
+  printf("\nCopying A to B lazily, then moving B to C\n");
+  lazy_buffer<int> a(SIZE / sizeof(int));
+  for (size_t i = 0; i < a.size(); i++)
+    a[i] = (int) i;
+  lazy_buffer<int> b(a.size());
+  b.copy_from(a, DELAY_MEMCPY_LAZY);
+  lazy_buffer<int> c(std::move(b));
+  if (b.data() || c[12345] != 12345 || c[c.size() - 1] != (int) c.size() - 1) {
+    printf("Move FAILED\n");
+    return 1;
+  }
+  printf("C[12345] = %d\n", c[12345]);
+
+  printf("\nCopying A to D lazily, then destroying D\n");
+  delay_memcpy_stats_t before, after;
+  delay_memcpy_get_stats(&before);
+  {
+    lazy_buffer<int> d(a.size());
+    d.copy_from(a, DELAY_MEMCPY_LAZY);
+  }
+  delay_memcpy_get_stats(&after);
+  printf("Bytes never copied: %lu\n", after.bytes_never_copied - before.bytes_never_copied);
+  if (after.bytes_copied != before.bytes_copied) {
+    printf("Destroying FAILED: %lu bytes copied\n", after.bytes_copied - before.bytes_copied);
+    return 1;
+  }
+
+  printf("\nCopying past the end of a buffer\n");
+  try {
+    lazy_buffer<int> f(16);
+    f.copy_from(a.data(), 10, 8);
+    printf("FAILED: copied past the end\n");
+    return 1;
+  }
+  catch (const std::out_of_range &) {
+    printf("Refused\n");
+  }
+
+  printf("\nCopying a string through a context\n");
+  lazy_buffer<char> e(16);
+  {
+    delaymemcpy::context context;
+    e.copy_from(context, "hello", 6);
+  }
+  printf("E = %s\n", e.data());
+  if (strcmp(e.data(), "hello")) {
+    printf("Context FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
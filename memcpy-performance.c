@@ -1,97 +1,363 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
-#include <sys/time.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "delaymemcpy.h"
 
-#define ARRAY_SIZE 0x40000 // 2^30=1GB
-
-#define NUM_EVENTS 10
-
-/* Arrays declared as global, as this allows program to use more
-   memory. Aligned to page boundaries so other global variables don't
-   end up in same page. */
-char __attribute__ ((aligned (0x1000))) array[ARRAY_SIZE];
-char __attribute__ ((aligned (0x1000))) copy[ARRAY_SIZE];
-char __attribute__ ((aligned (0x1000))) copy2[ARRAY_SIZE];
-
-void *random_array(void *array, size_t size) {
-  
-  int i;
-  size /= sizeof(long);
-  for (i = 0; i < size; i++)
-    ((long *)array)[i] = random();
-  
-  return array;
+/* Benchmark of delay_memcpy against memcpy. For every combination of
+   copy size, access pattern and touched fraction, the copy followed
+   by the accesses is timed over several repetitions, once with memcpy
+   (eager), once with delay_memcpy kept pending (lazy), and once with
+   delay_memcpy choosing by itself (auto), and the percentiles of each
+   are written as CSV or JSON. Comparing the modes for the same
+   pattern shows where lazy copying pays off, and whether the
+   automatic choice follows. The flush pattern is measured with each
+   number of flush threads given, to show how delay_memcpy_flush_all
+   scales.
+
+   Usage: memcpy-performance [-s sizes] [-p patterns] [-f fractions]
+                             [-t threads] [-r repetitions] [-o csv|json]
+
+   Lists are separated by commas. Sizes take a K, M or G suffix.
+
+   The default sizes stop at 256M: three buffers of the largest size
+   are mapped and fully touched, so 1G and 4G take 3 GB and 12 GB of
+   memory. Pass them with -s on machines that have it, for instance
+   -s 4K,64K,1M,16M,256M,1G,4G.
+ */
+
+#define DEFAULT_SIZES "4K,64K,1M,16M,256M"
+#define DEFAULT_PATTERNS "none,sequential,random,strided,src-write,chained,flush"
+#define DEFAULT_FRACTIONS "0.01,0.1,0.5,1"
+#define DEFAULT_THREADS "1,2,4,8"
+#define DEFAULT_REPETITIONS 10
+
+#define MAX_LIST 64
+
+#define PAGE 0x1000
+#define CACHE_LINE 64
+
+/* Access patterns, applied to the touched fraction of the pages:
+
+   - none: nothing is accessed after the copy.
+   - sequential: the destination is read from the start, a word per
+     cache line.
+   - random: pages of the destination are read, a word per cache line,
+     in random order.
+   - strided: evenly spaced pages of the destination are read, a word
+     per cache line.
+   - src-write: pages of the source are written in random order, a
+     word per cache line.
+   - chained: the destination is copied again to a third buffer, whose
+     start is then read like with the sequential pattern.
+   - flush: the whole copy is performed with delay_memcpy_flush_all,
+     regardless of the fraction.
+ */
+enum pattern { NONE, SEQUENTIAL, RANDOM, STRIDED, SRC_WRITE, CHAINED, FLUSH };
+
+const char *pattern_names[] = { "none", "sequential", "random", "strided", "src-write", "chained", "flush" };
+
+#define NUM_PATTERNS (sizeof(pattern_names) / sizeof(pattern_names[0]))
+
+/* Ways to copy, in the order they are measured. */
+enum mode { EAGER, LAZY, AUTO };
+
+const char *mode_names[] = { "eager", "lazy", "auto" };
+
+#define NUM_MODES (sizeof(mode_names) / sizeof(mode_names[0]))
+
+/* Buffers of the benchmark, large enough for the largest size. */
+char *src, *dst, *dst2;
+
+/* Offsets of the pages to touch, in order, and their number. */
+size_t *pages;
+size_t num_pages;
+
+/* Sink for the data read, so the reads are not optimized out. */
+volatile long sink;
+
+/* Returns the current time of the monotonic clock, in nanoseconds. */
+uint64_t now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Parses a size with an optional K, M or G suffix. */
+size_t parse_size(const char *text) {
+
+  char *end;
+  size_t size = strtoull(text, &end, 0);
+
+  switch (*end) {
+  case 'G': case 'g': size <<= 10; // fall through
+  case 'M': case 'm': size <<= 10; // fall through
+  case 'K': case 'k': size <<= 10;
+  }
+  return size;
 }
 
-void print_array(char *array) {
-  int i;
-  printf("%p: \n\t", array);
-  for (i = 0; i < 10; i++)
-    printf("%02x ", (unsigned char) ++array[i]);
-  printf("\n");
+/* Splits a comma separated list in place. Returns the number of items. */
+int split_list(char *list, char **items) {
+
+  int count = 0;
+  char *item;
+
+  for (item = strtok(list, ","); item && count < MAX_LIST; item = strtok(NULL, ","))
+    items[count++] = item;
+  return count;
+}
+
+/* Maps a buffer of 'size' bytes, and touches all of its pages so they
+   do not fault during the measurements. */
+char *map_buffer(size_t size) {
+
+  char *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (buffer == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memset(buffer, 1, size);
+  return buffer;
 }
 
-void sequence_of_events(char *dst, char *src, size_t size) {
-  
-  int event;
-  volatile char last_data = 0;
-  
-  // Uses value to avoid warning or compilation optimizations
-  (char) last_data;
-  
-  for (event = 0; event < NUM_EVENTS; event++) {
-    
-    switch(random() % 4) {
-    case 0:
-      last_data = src[random() % size];
-      break;
-    case 1:
-      last_data = dst[random() % size];
-      break;
-    case 2:
-      src[random() % size] = (char) random();
-      break;
-    case 3:
-      dst[random() % size] = (char) random();
-      break;
+/* Fills 'pages' with the offsets of the pages of a 'size' bytes
+   buffer touched by 'pattern' for a fraction 'fraction' of them. */
+void plan_accesses(enum pattern pattern, size_t size, double fraction) {
+
+  size_t total = (size + PAGE - 1) / PAGE;
+  size_t i;
+
+  num_pages = total * fraction;
+  if (num_pages == 0)
+    num_pages = 1;
+  if (num_pages > total)
+    num_pages = total;
+
+  if (pattern == STRIDED) {
+    for (i = 0; i < num_pages; i++)
+      pages[i] = i * (total / num_pages) * PAGE;
+    return;
+  }
+
+  for (i = 0; i < total; i++)
+    pages[i] = i * PAGE;
+
+  if (pattern == RANDOM || pattern == SRC_WRITE)
+    for (i = 0; i < num_pages; i++) {
+      size_t j = i + random() % (total - i);
+      size_t page = pages[i];
+      pages[i] = pages[j];
+      pages[j] = page;
     }
+}
+
+/* Reads a word per cache line of the planned pages of 'buffer'. */
+void read_pages(char *buffer, size_t size) {
+
+  long sum = 0;
+  size_t i, offset;
+
+  for (i = 0; i < num_pages; i++)
+    for (offset = pages[i]; offset < pages[i] + PAGE && offset < size; offset += CACHE_LINE)
+      sum += *(long *) (buffer + offset);
+  sink = sum;
+}
+
+/* Writes a word per cache line of the planned pages of 'buffer'. */
+void write_pages(char *buffer, size_t size) {
+
+  size_t i, offset;
+
+  for (i = 0; i < num_pages; i++)
+    for (offset = pages[i]; offset < pages[i] + PAGE && offset < size; offset += CACHE_LINE)
+      *(long *) (buffer + offset) = offset;
+}
+
+void *eager_memcpy(void *dst, void *src, size_t size) {
+
+  return memcpy(dst, src, size);
+}
+
+void *lazy_memcpy(void *dst, void *src, size_t size) {
+
+  return delay_memcpy_flags(dst, src, size, DELAY_MEMCPY_LAZY);
+}
+
+/* Returns the time, in nanoseconds, taken to copy 'size' bytes the
+   way given by 'mode', and to access the buffers following
+   'pattern'. */
+uint64_t run_once(enum pattern pattern, size_t size, enum mode mode) {
+
+  void *(*copy)(void *, void *, size_t) =
+    mode == EAGER ? eager_memcpy : mode == LAZY ? lazy_memcpy : delay_memcpy;
+  uint64_t start = now();
+
+  copy(dst, src, size);
+
+  switch (pattern) {
+  case NONE:
+    break;
+  case SEQUENTIAL:
+  case RANDOM:
+  case STRIDED:
+    read_pages(dst, size);
+    break;
+  case SRC_WRITE:
+    write_pages(src, size);
+    break;
+  case CHAINED:
+    copy(dst2, dst, size);
+    read_pages(dst2, size);
+    break;
+  case FLUSH:
+    delay_memcpy_flush_all();
+    break;
   }
+
+  uint64_t time = now() - start;
+
+  // drop whatever was not needed, outside of the measurement
+  if (mode != EAGER)
+    reset_pending_copy_slots();
+  return time;
+}
+
+int compare_times(const void *a, const void *b) {
+
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Returns percentile 'p' of the sorted 'count' times. */
+uint64_t percentile(uint64_t *times, int count, int p) {
+
+  return times[(count - 1) * p / 100];
 }
 
-int main(void) {
-  
-  struct timeval start, end, diff;
-  
+int main(int argc, char **argv) {
+
+  char sizes_list[256] = DEFAULT_SIZES;
+  char patterns_list[256] = DEFAULT_PATTERNS;
+  char fractions_list[256] = DEFAULT_FRACTIONS;
+  char threads_list[256] = DEFAULT_THREADS;
+  char *size_items[MAX_LIST], *pattern_items[MAX_LIST], *fraction_items[MAX_LIST];
+  char *thread_items[MAX_LIST];
+  int num_sizes, num_patterns, num_fractions, num_threads;
+  int repetitions = DEFAULT_REPETITIONS;
+  int json = 0, first_row = 1;
+  size_t max_size = 0;
+  uint64_t *times;
+  int opt, s, p, f, t, r;
+  enum mode mode;
+
+  while ((opt = getopt(argc, argv, "s:p:f:t:r:o:")) != -1) {
+    switch (opt) {
+    case 's': snprintf(sizes_list, sizeof(sizes_list), "%s", optarg); break;
+    case 'p': snprintf(patterns_list, sizeof(patterns_list), "%s", optarg); break;
+    case 'f': snprintf(fractions_list, sizeof(fractions_list), "%s", optarg); break;
+    case 't': snprintf(threads_list, sizeof(threads_list), "%s", optarg); break;
+    case 'r': repetitions = atoi(optarg); break;
+    case 'o': json = !strcmp(optarg, "json"); break;
+    default:
+      fprintf(stderr, "Usage: %s [-s sizes] [-p patterns] [-f fractions] [-t threads] "
+	      "[-r repetitions] [-o csv|json]\n"
+	      "Default sizes: " DEFAULT_SIZES " (add 1G,4G with -s if there is 3 times that much memory)\n",
+	      argv[0]);
+      return 1;
+    }
+  }
+  if (repetitions < 1)
+    repetitions = 1;
+
+  num_sizes = split_list(sizes_list, size_items);
+  num_patterns = split_list(patterns_list, pattern_items);
+  num_fractions = split_list(fractions_list, fraction_items);
+  num_threads = split_list(threads_list, thread_items);
+
+  for (s = 0; s < num_sizes; s++)
+    if (parse_size(size_items[s]) > max_size)
+      max_size = parse_size(size_items[s]);
+  max_size = (max_size + PAGE - 1) & -PAGE;
+
   srandom(time(NULL));
-  
   initialize_delay_memcpy_data();
-  
-  printf("Initializing array (%d elements)...\n", ARRAY_SIZE);
-  random_array(array, ARRAY_SIZE);
-  
-  print_array(array);
-  
-  printf("Copying array (normal)...\n");
-  gettimeofday(&start, NULL);
-  memcpy(copy, array, ARRAY_SIZE);
-  sequence_of_events(copy, array, ARRAY_SIZE);
-  gettimeofday(&end, NULL);
-  
-  timersub(&end, &start, &diff);
-  printf("%ld.%06ld\n", diff.tv_sec, diff.tv_usec);
-  
-  printf("Copying array (delayed)...\n");
-  gettimeofday(&start, NULL);
-  delay_memcpy(copy2, array, ARRAY_SIZE);
-  sequence_of_events(copy2, array, ARRAY_SIZE);
-  gettimeofday(&end, NULL);
-  
-  timersub(&end, &start, &diff);
-  printf("%ld.%06ld\n", diff.tv_sec, diff.tv_usec);
-  
+
+  src = map_buffer(max_size);
+  dst = map_buffer(max_size);
+  dst2 = map_buffer(max_size);
+  pages = malloc(max_size / PAGE * sizeof(*pages));
+  times = malloc(repetitions * sizeof(*times));
+
+  if (json)
+    printf("[\n");
+  else
+    printf("size,pattern,fraction,mode,threads,repetitions,min_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+
+  for (s = 0; s < num_sizes; s++)
+    for (p = 0; p < num_patterns; p++)
+      for (f = 0; f < num_fractions; f++)
+	for (mode = 0; mode < NUM_MODES; mode++) {
+
+	  size_t size = parse_size(size_items[s]);
+	  double fraction = atof(fraction_items[f]);
+	  enum pattern pattern;
+
+	  for (pattern = 0; pattern < NUM_PATTERNS; pattern++)
+	    if (!strcmp(pattern_items[p], pattern_names[pattern]))
+	      break;
+	  if (pattern == NUM_PATTERNS) {
+	    fprintf(stderr, "Unknown pattern %s\n", pattern_items[p]);
+	    return 1;
+	  }
+	  if (size == 0 || size > max_size)
+	    continue;
+
+	  plan_accesses(pattern, size, fraction);
+
+	  // only flushes depend on the number of threads
+	  for (t = 0; t < (pattern == FLUSH && mode != EAGER ? num_threads : 1); t++) {
+
+	    int threads = pattern == FLUSH && mode != EAGER ? atoi(thread_items[t]) : 1;
+
+	    delay_memcpy_set_flush_threads(threads);
+	    for (r = 0; r < repetitions; r++)
+	      times[r] = run_once(pattern, size, mode);
+	    qsort(times, repetitions, sizeof(*times), compare_times);
+
+	    if (json)
+	      printf("%s  {\"size\": %zu, \"pattern\": \"%s\", \"fraction\": %g, \"mode\": \"%s\", "
+		     "\"threads\": %d, \"repetitions\": %d, \"min_ns\": %llu, \"p50_ns\": %llu, "
+		     "\"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+		     first_row ? "" : ",\n", size, pattern_names[pattern], fraction,
+		     mode_names[mode], threads, repetitions,
+		     (unsigned long long) times[0],
+		     (unsigned long long) percentile(times, repetitions, 50),
+		     (unsigned long long) percentile(times, repetitions, 90),
+		     (unsigned long long) percentile(times, repetitions, 99),
+		     (unsigned long long) times[repetitions - 1]);
+	    else
+	      printf("%zu,%s,%g,%s,%d,%d,%llu,%llu,%llu,%llu,%llu\n",
+		     size, pattern_names[pattern], fraction, mode_names[mode], threads, repetitions,
+		     (unsigned long long) times[0],
+		     (unsigned long long) percentile(times, repetitions, 50),
+		     (unsigned long long) percentile(times, repetitions, 90),
+		     (unsigned long long) percentile(times, repetitions, 99),
+		     (unsigned long long) times[repetitions - 1]);
+	    first_row = 0;
+	    fflush(stdout);
+	  }
+	}
+
+  if (json)
+    printf("\n]\n");
+
   return 0;
 }
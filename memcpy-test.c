@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "delaymemcpy.h"
 
@@ -33,6 +37,677 @@ void print_array(unsigned char *array, int size) {
   printf("\n");
 }
 
+/* Creates an unlinked temporary file holding 'size' bytes of value
+   'c'. Returns its file descriptor, or -1 on failure. */
+int temporary_file(int c, size_t size) {
+
+  char path[] = "/tmp/memcpy-test-XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  memset(copy2, c, size);
+  if (write(fd, copy2, size) != (ssize_t) size) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Reads a file lazily, then writes and truncates the file: the data
+   read must not change, nor fault. Returns 1 on failure. */
+int test_read_fd_snapshot(void) {
+
+  int fd = temporary_file('a', 0x4000);
+
+  printf("\nReading a file lazily, then writing and truncating the file\n");
+  delay_memcpy_flush_all();
+  if (fd < 0 || delay_read_fd(copy, fd, 0, 0x4000) != 0x4000) {
+    printf("Read FAILED\n");
+    return 1;
+  }
+  delay_memcpy_sync(copy, 0x4000);
+  if (pwrite(fd, "b", 1, 0x1000) != 1 || ftruncate(fd, 0) < 0) {
+    printf("Write FAILED\n");
+    return 1;
+  }
+  printf("Destination :");
+  print_array(copy + 0x1000, 8);
+  close(fd);
+  if (copy[0x1000] != 'a' || copy[0x3fff] != 'a') {
+    printf("Snapshot FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Maps a shared temporary file of 'size' bytes of value 'c', out of
+   the page cache, so that its pages are not resident. Returns the
+   mapping, or NULL on failure. */
+unsigned char *map_shared_file(int c, size_t size) {
+
+  int fd = temporary_file(c, size);
+  unsigned char *map;
+
+  if (fd < 0)
+    return NULL;
+  fsync(fd);
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+  close(fd);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/* Fills a shared file mapping with zeros: its pages must not be
+   dropped, as they would read the file again. Returns 1 on failure. */
+int test_zero_fill_shared(void) {
+
+  unsigned char *map = map_shared_file(0xab, 0x4000);
+
+  printf("\nFilling a shared file mapping with zeros\n");
+  if (!map || !delay_memset(map, 0, 0x4000)) {
+    printf("Fill FAILED\n");
+    return 1;
+  }
+  delay_memcpy_sync(map, 0x4000);
+  printf("Destination :");
+  print_array(map + 0x1000, 8);
+  if (map[0x1000] != 0 || map[0x3fff] != 0) {
+    printf("Zero fill FAILED\n");
+    return 1;
+  }
+  munmap(map, 0x4000);
+  return 0;
+}
+
+/* Copies zeros with zero pages looked for, into private anonymous
+   memory, whose pages must be dropped, then into a shared file
+   mapping, whose pages must be copied to. Returns 1 on failure. */
+int test_zero_pages(void) {
+
+  unsigned char *map = map_shared_file(0xab, 0x4000);
+  delay_memcpy_stats_t before, after;
+
+  printf("\nCopying zero pages to private and to shared memory\n");
+  delay_memcpy_flush_all();
+  delay_memcpy_set_zero_pages(1);
+  memset(array, 0, 0x4000);
+  memset(copy, 0xab, 0x4000);
+
+  delay_memcpy_get_stats(&before);
+  delay_memcpy_flags(copy, array, 0x4000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_sync(copy, 0x4000);
+  delay_memcpy_get_stats(&after);
+  printf("Private: %lu pages skipped\n", after.zero_pages_skipped - before.zero_pages_skipped);
+  if (after.zero_pages_skipped == before.zero_pages_skipped || copy[0x1000] || copy[0x3fff]) {
+    printf("Skipping FAILED\n");
+    return 1;
+  }
+
+  delay_memcpy_get_stats(&before);
+  delay_memcpy_flags(map, array, 0x4000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_sync(map, 0x4000);
+  delay_memcpy_get_stats(&after);
+  delay_memcpy_set_zero_pages(0);
+  printf("Shared: %lu pages skipped\n", after.zero_pages_skipped - before.zero_pages_skipped);
+  if (!map || after.zero_pages_skipped != before.zero_pages_skipped || map[0x1388] || map[0x3fff]) {
+    printf("Refusing to skip FAILED\n");
+    return 1;
+  }
+  munmap(map, 0x4000);
+  return 0;
+}
+
+/* Returns the number of faults counted so far */
+unsigned long fault_count(void) {
+
+  delay_memcpy_stats_t stats;
+
+  delay_memcpy_get_stats(&stats);
+  return stats.faults_src_read + stats.faults_dst_read + stats.faults_write;
+}
+
+/* Registers thousands of one-page copies to every other page, reads
+   them back in a scattered order, then lowers the capacity: the
+   oldest copies must be performed to make room. Returns 1 on
+   failure. */
+int test_many_copies(void) {
+
+  size_t capacity = delay_memcpy_get_capacity();
+  delay_memcpy_stats_t before, after;
+  size_t i, page;
+
+  printf("\nCopying 4096 pages one by one, then lowering the capacity\n");
+  delay_memcpy_flush_all();
+  random_array(array, 0x2000000);
+  if (delay_memcpy_reserve(4096)) {
+    printf("Reserve FAILED\n");
+    return 1;
+  }
+  delay_memcpy_get_stats(&before);
+  for (i = 0; i < 4096; i++)
+    delay_memcpy_flags(copy + i * 0x2000, array + i * 0x2000, 0x1000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_get_stats(&after);
+  printf("Pending: %lu\n", after.pending_copies - before.pending_copies);
+  if (after.pending_copies - before.pending_copies != 4096) {
+    printf("Registering FAILED\n");
+    return 1;
+  }
+  for (i = 0; i < 2048; i++) {
+    page = (i * 2473) % 4096;
+    if (memcmp(copy + page * 0x2000, array + page * 0x2000, 0x1000)) {
+      printf("Copy of page %zu FAILED\n", page);
+      return 1;
+    }
+  }
+
+  delay_memcpy_set_capacity(100);
+  delay_memcpy_get_stats(&after);
+  delay_memcpy_set_capacity(capacity);
+  printf("Pending: %lu, evicted: %lu\n", after.pending_copies,
+	 after.forced_evictions - before.forced_evictions);
+  if (after.pending_copies > 100 || after.forced_evictions == before.forced_evictions) {
+    printf("Capacity FAILED\n");
+    return 1;
+  }
+  for (i = 0; i < 4096; i++)
+    if (memcmp(copy + i * 0x2000, array + i * 0x2000, 0x1000)) {
+      printf("Copy of page %zu FAILED\n", i);
+      return 1;
+    }
+  return 0;
+}
+
+/* Copies lazily with the userfaultfd backend, if available, and reads
+   the copy back. Returns 1 on failure. */
+int test_userfaultfd(void) {
+
+  printf("\nCopying with the userfaultfd backend\n");
+  delay_memcpy_flush_all();
+  if (delay_memcpy_set_backend(DELAY_MEMCPY_BACKEND_USERFAULTFD)) {
+    printf("Not available\n");
+    return 0;
+  }
+  random_array(array, 0x10000);
+  memset(copy, 0, 0x10000);
+  delay_memcpy_flags(copy + 0x800, array + 0x800, 0xf000, DELAY_MEMCPY_LAZY);
+  array[0x4000]++;
+  delay_memcpy_set_backend(DELAY_MEMCPY_BACKEND_SIGSEGV);
+  printf("Destination :");
+  print_array(copy + 0x4000, 8);
+  if (copy[0x4000] != (unsigned char) (array[0x4000] - 1) ||
+      memcmp(copy + 0x800, array + 0x800, 0x3800) ||
+      memcmp(copy + 0x4001, array + 0x4001, 0xb7ff) || copy[0x7ff] || copy[0xf800]) {
+    printf("Userfaultfd copy FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Copies between two buffers of delay_memcpy_alloc, whose pages are
+   remapped rather than copied, then writes both sides: each must keep
+   its own data. Returns 1 on failure. */
+int test_remap(void) {
+
+  unsigned char *a = delay_memcpy_alloc(0x10000);
+  unsigned char *b = delay_memcpy_alloc(0x10000);
+  delay_memcpy_stats_t before, after;
+
+  printf("\nCopying between allocated buffers, then writing both\n");
+  if (!a || !b) {
+    printf("Allocation FAILED\n");
+    return 1;
+  }
+  random_array(a, 0x10000);
+  memcpy(copy, a, 0x10000);
+  delay_memcpy_get_stats(&before);
+  delay_memcpy_flags(b, a, 0x10000, DELAY_MEMCPY_LAZY);
+  a[0x2000]++;
+  b[0x3000]++;
+  copy[0x3000]++;
+  delay_memcpy_get_stats(&after);
+  printf("Bytes copied: %lu\n", after.bytes_copied - before.bytes_copied);
+  if (memcmp(b, copy, 0x10000) || a[0x3000] == b[0x3000] || a[0x2000] == b[0x2000]) {
+    printf("Remapped copy FAILED\n");
+    return 1;
+  }
+  delay_memcpy_free(a);
+  delay_memcpy_free(b);
+  return 0;
+}
+
+/* Reads a large copy sequentially: the pages performed on each fault
+   must grow, so that most pages take no fault. Returns 1 on
+   failure. */
+int test_fault_ahead(void) {
+
+  delay_memcpy_stats_t before, after;
+  unsigned long faults;
+  size_t i;
+
+  printf("\nReading a 4MB copy sequentially\n");
+  delay_memcpy_flush_all();
+  random_array(array, 0x400000);
+  delay_memcpy_get_stats(&before);
+  faults = fault_count();
+  delay_memcpy_flags(copy, array, 0x400000, DELAY_MEMCPY_LAZY);
+  for (i = 0; i < 0x400000; i += 0x1000)
+    if (copy[i] != array[i]) {
+      printf("Copy FAILED\n");
+      return 1;
+    }
+  delay_memcpy_get_stats(&after);
+  faults = fault_count() - faults;
+  printf("Faults: %lu, avoided: %lu\n", faults, after.faults_avoided - before.faults_avoided);
+  if (faults >= 0x400 / 4 || after.faults_avoided == before.faults_avoided) {
+    printf("Fault-ahead FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Tracks copies in 64K pages: touching each takes one fault, and the
+   granularity cannot change while copies are pending. Returns 1 on
+   failure. */
+int test_granularity(void) {
+
+  size_t granularity = delay_memcpy_get_granularity();
+  unsigned char *dst = (unsigned char *) (((uintptr_t) copy + 0xffff) & ~(uintptr_t) 0xffff);
+  size_t min_bytes, max_bytes;
+  unsigned long faults;
+  size_t i;
+
+  printf("\nCopying with a granularity of 64K\n");
+  delay_memcpy_flush_all();
+  delay_memcpy_get_fault_ahead(&min_bytes, &max_bytes);
+  if (delay_memcpy_set_granularity(0x10000) || delay_memcpy_set_fault_ahead(0x10000, 0x10000)) {
+    printf("Setting FAILED\n");
+    return 1;
+  }
+  random_array(array, 0x40000);
+  faults = fault_count();
+  delay_memcpy_flags(dst, array, 0x40000, DELAY_MEMCPY_LAZY);
+  if (!delay_memcpy_set_granularity(granularity)) {
+    printf("Changing while pending FAILED\n");
+    return 1;
+  }
+  for (i = 0x40000; i > 0; i -= 0x1000)
+    if (dst[i - 1] != array[i - 1]) {
+      printf("Copy FAILED\n");
+      return 1;
+    }
+  faults = fault_count() - faults;
+  delay_memcpy_flush_all();
+  delay_memcpy_set_granularity(granularity);
+  delay_memcpy_set_fault_ahead(min_bytes, max_bytes);
+  printf("Faults: %lu\n", faults);
+  if (faults != 4) {
+    printf("Granularity FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Syncs one page of a copy, cancels the rest, and checks what the
+   statistics report. Returns 1 on failure. */
+int test_sync_cancel(void) {
+
+  delay_memcpy_stats_t before, after;
+
+  printf("\nSyncing one page of a copy, then cancelling it\n");
+  delay_memcpy_flush_all();
+  random_array(array, 0x4000);
+  delay_memcpy_get_stats(&before);
+  delay_memcpy_flags(copy, array, 0x4000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_sync(copy + 0x1800, 0x10);
+  delay_memcpy_cancel(copy, 0x4000);
+  array[0x1000]++;
+  delay_memcpy_get_stats(&after);
+  printf("Registered: %lu, copied: %lu, never copied: %lu\n",
+	 after.bytes_registered - before.bytes_registered,
+	 after.bytes_copied - before.bytes_copied,
+	 after.bytes_never_copied - before.bytes_never_copied);
+  if (after.copies_registered - before.copies_registered != 1 ||
+      after.bytes_registered - before.bytes_registered != 0x4000 ||
+      after.bytes_copied - before.bytes_copied != 0x1000 ||
+      after.bytes_never_copied - before.bytes_never_copied != 0x3000 ||
+      after.pending_copies || copy[0x1000] != (unsigned char) (array[0x1000] - 1) ||
+      memcmp(copy + 0x1001, array + 0x1001, 0xfff)) {
+    printf("Sync and cancel FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Copies A to B, then C over the whole of B before B is read: the
+   first copy must never be performed. Returns 1 on failure. */
+int test_dead_copy(void) {
+
+  delay_memcpy_stats_t before, after;
+
+  printf("\nCopying A to B, then C to B\n");
+  delay_memcpy_flush_all();
+  random_array(array, 0x4000);
+  random_array(copy2, 0x4000);
+  delay_memcpy_get_stats(&before);
+  delay_memcpy_flags(copy, array, 0x4000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_flags(copy, copy2, 0x4000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_flush_all();
+  delay_memcpy_get_stats(&after);
+  printf("Copied: %lu, never copied: %lu\n", after.bytes_copied - before.bytes_copied,
+	 after.bytes_never_copied - before.bytes_never_copied);
+  if (memcmp(copy, copy2, 0x4000) || after.bytes_copied - before.bytes_copied != 0x4000 ||
+      after.bytes_never_copied - before.bytes_never_copied != 0x4000) {
+    printf("Dead copy FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Copies A to three destinations, then writes A: every destination
+   must get the data from before the write. Returns 1 on failure. */
+int test_fan_out(void) {
+
+  delay_memcpy_stats_t before, after;
+  int i;
+
+  printf("\nCopying A to three destinations, then writing A\n");
+  delay_memcpy_flush_all();
+  random_array(array, 0x4000);
+  memcpy(copy2 + 0x10000, array, 0x4000);
+  delay_memcpy_get_stats(&before);
+  for (i = 0; i < 3; i++)
+    delay_memcpy_flags(copy + i * 0x10000, array, 0x4000, DELAY_MEMCPY_LAZY);
+  memset(array, 0, 0x4000);
+  delay_memcpy_get_stats(&after);
+  printf("Fanned out: %lu\n", after.copies_fanned_out - before.copies_fanned_out);
+  for (i = 0; i < 3; i++)
+    if (memcmp(copy + i * 0x10000, copy2 + 0x10000, 0x4000)) {
+      printf("Fan-out FAILED\n");
+      return 1;
+    }
+  if (after.copies_fanned_out == before.copies_fanned_out) {
+    printf("Fan-out FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Flushes many large copies with several threads, copying with
+   non-temporal stores. Returns 1 on failure. */
+int test_parallel_flush(void) {
+
+  size_t threshold = delay_memcpy_get_streaming_threshold();
+  int i;
+
+  printf("\nFlushing 32MB of copies with 4 threads\n");
+  delay_memcpy_flush_all();
+  if (delay_memcpy_set_flush_threads(4)) {
+    printf("Setting FAILED\n");
+    return 1;
+  }
+  delay_memcpy_set_streaming_threshold(0x100000);
+  random_array(array, 0x2000000);
+  for (i = 0; i < 32; i++)
+    delay_memcpy_flags(copy + i * 0x100000 + 0x10, array + i * 0x100000, 0x100000 - 0x10,
+		       DELAY_MEMCPY_LAZY);
+  delay_memcpy_flush_all();
+  delay_memcpy_set_flush_threads(1);
+  delay_memcpy_set_streaming_threshold(threshold);
+  printf("Destination :");
+  print_array(copy + 0x1f00010, 8);
+  for (i = 0; i < 32; i++)
+    if (memcmp(copy + i * 0x100000 + 0x10, array + i * 0x100000, 0x100000 - 0x10)) {
+      printf("Parallel flush FAILED\n");
+      return 1;
+    }
+  return 0;
+}
+
+/* Records a trace of a copy and its faults, checks it, and replays it
+   with delaymemcpy-replay. Returns 1 on failure. */
+int test_trace(void) {
+
+  char path[] = "/tmp/memcpy-test-XXXXXX";
+  char command[64];
+  int fd = mkstemp(path);
+  delay_memcpy_trace_header_t header;
+  delay_memcpy_trace_event_t event;
+  int copies = 0, faults = 0;
+
+  printf("\nRecording and replaying a trace\n");
+  delay_memcpy_flush_all();
+  if (fd < 0 || delay_memcpy_start_trace(100)) {
+    printf("Start FAILED\n");
+    return 1;
+  }
+  random_array(array, 0x4000);
+  delay_memcpy_flags(copy, array, 0x4000, DELAY_MEMCPY_LAZY);
+  copy[0x2000]++;
+  delay_memcpy_flush_all();
+  if (delay_memcpy_dump_trace(fd) < 2) {
+    printf("Dump FAILED\n");
+    return 1;
+  }
+  delay_memcpy_stop_trace();
+
+  lseek(fd, 0, SEEK_SET);
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, DELAY_MEMCPY_TRACE_MAGIC, sizeof(header.magic))) {
+    printf("Header FAILED\n");
+    return 1;
+  }
+  while (read(fd, &event, sizeof(event)) == sizeof(event)) {
+    copies += event.type == DELAY_MEMCPY_TRACE_COPY && event.dst == (uintptr_t) copy;
+    faults += event.type == DELAY_MEMCPY_TRACE_FAULT && event.addr == (uintptr_t) (copy + 0x2000) &&
+      (event.flags & DELAY_MEMCPY_TRACE_WRITE);
+  }
+  close(fd);
+  printf("Events: %lu, copies: %d, faults: %d\n", (unsigned long) header.events, copies, faults);
+
+  snprintf(command, sizeof(command), "./delaymemcpy-replay %s > /dev/null", path);
+  if (copies != 1 || faults != 1 || system(command)) {
+    printf("Trace FAILED\n");
+    unlink(path);
+    return 1;
+  }
+  unlink(path);
+  return 0;
+}
+
+/* Runs sed on a 4MB line with and without the interposer, whose large
+   copies then go through the engine: the output must be the same.
+   Returns 1 on failure. */
+int test_preload(void) {
+
+  char path[] = "/tmp/memcpy-test-XXXXXX";
+  char command[256];
+  int fd = mkstemp(path);
+  int i, result;
+
+  printf("\nRunning sed with the interposer\n");
+  if (fd < 0) {
+    printf("File FAILED\n");
+    return 1;
+  }
+  for (i = 0; i < 0x400000; i++)
+    copy2[i] = 'a' + random() % 26;
+  copy2[0x400000] = '\n';
+  result = write(fd, copy2, 0x400001) != 0x400001;
+  close(fd);
+  if (result) {
+    printf("File FAILED\n");
+    unlink(path);
+    return 1;
+  }
+
+  snprintf(command, sizeof(command),
+	   "sed s/a/b/g %s > %s.ref && LD_PRELOAD=./libdelaymemcpy-preload.so "
+	   "DELAY_MEMCPY_PRELOAD_MODE=lazy sed s/a/b/g %s | cmp -s - %s.ref", path, path, path, path);
+  result = system(command);
+  unlink(path);
+  strcat(path, ".ref");
+  unlink(path);
+  if (result) {
+    printf("Interposed sed FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Lets automatic copies choose their mode after large copies that are
+   never touched: small copies must still be performed right away, and
+   large ones must be kept pending. Returns 1 on failure. */
+int test_auto_mode(void) {
+
+  delay_memcpy_stats_t before, after;
+
+  printf("\nChoosing the mode of small and large automatic copies\n");
+  delay_memcpy_flush_all();
+  for (int i = 0; i < 8; i++) {
+    delay_memcpy_flags(copy, array, 0x4000000, DELAY_MEMCPY_LAZY);
+    delay_memcpy_cancel(copy, 0x4000000);
+  }
+
+  delay_memcpy_get_stats(&before);
+  delay_memcpy(copy, array, 0x1000);
+  delay_memcpy(copy, array, 0x10000);
+  delay_memcpy_get_stats(&after);
+  printf("Small: %lu of 2 right away\n", after.copies_eager - before.copies_eager);
+  if (after.copies_eager - before.copies_eager != 2) {
+    printf("Small copy mode FAILED\n");
+    return 1;
+  }
+
+  delay_memcpy_get_stats(&before);
+  delay_memcpy(copy, array, 0x4000000);
+  delay_memcpy_get_stats(&after);
+  delay_memcpy_cancel(copy, 0x4000000);
+  printf("Large: %lu of 1 pending\n", after.copies_registered - before.copies_registered);
+  if (after.copies_registered - before.copies_registered != 1) {
+    printf("Large copy mode FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Starts the drain thread, lets it perform a copy in the background,
+   then stops it: the copy must be in place without any fault, and
+   copies must no longer be forced, so that zero pages are skipped
+   again. Returns 1 on failure. */
+int test_drain_start_stop(void) {
+
+  struct timespec delay = { 0, 1000000 };
+  delay_memcpy_stats_t before, after;
+  int i;
+
+  printf("\nDraining a copy in the background, then stopping the drain\n");
+  delay_memcpy_flush_all();
+  if (delay_memcpy_start_drain(0, -1) || !delay_memcpy_start_drain(0, -1)) {
+    printf("Start FAILED\n");
+    return 1;
+  }
+  random_array(array, 0x40000);
+  delay_memcpy_get_stats(&before);
+  delay_memcpy_flags(copy, array, 0x40000, DELAY_MEMCPY_DRAIN);
+  for (i = 0; i < 2000; i++) {
+    delay_memcpy_get_stats(&after);
+    if (after.bytes_copied - before.bytes_copied >= 0x40000)
+      break;
+    nanosleep(&delay, NULL);
+  }
+  if (memcmp(copy, array, 0x40000)) {
+    printf("Drained copy FAILED\n");
+    return 1;
+  }
+  delay_memcpy_get_stats(&after);
+  printf("Faults: %lu\n", after.faults_dst_read - before.faults_dst_read);
+  if (after.faults_dst_read != before.faults_dst_read) {
+    printf("Draining FAILED\n");
+    return 1;
+  }
+  delay_memcpy_stop_drain();
+  delay_memcpy_stop_drain();
+
+  delay_memcpy_set_zero_pages(1);
+  memset(array, 0, 0x4000);
+  delay_memcpy_get_stats(&before);
+  delay_memcpy_flags(copy, array, 0x4000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_sync(copy, 0x4000);
+  delay_memcpy_get_stats(&after);
+  delay_memcpy_set_zero_pages(0);
+  printf("Stopped: %lu pages skipped\n", after.zero_pages_skipped - before.zero_pages_skipped);
+  if (after.zero_pages_skipped == before.zero_pages_skipped) {
+    printf("Stopping FAILED\n");
+    return 1;
+  }
+  return 0;
+}
+
+#define CONTEXT_THREADS 4
+#define CONTEXT_SIZE 0x40000
+
+/* Value of byte 'i' of A in test_contexts */
+#define CONTEXT_BYTE(i) ((unsigned char) ((i) * 7))
+
+/* Body of the threads of test_contexts: copies its own part of A to B,
+   then B to C, lazily in a context of its own, checks C, writes A,
+   and checks B once the context is destroyed. Returns non-NULL on
+   failure. */
+void *context_thread(void *arg) {
+
+  size_t offset = (size_t) arg * CONTEXT_SIZE;
+  delay_memcpy_context_t *context = delay_memcpy_create_context(DELAY_MEMCPY_LAZY);
+  size_t i;
+
+  if (!context)
+    return "context";
+  delay_memcpy_in_context(context, copy + offset, array + offset, CONTEXT_SIZE);
+  delay_memcpy_in_context(context, copy2 + offset, copy + offset, CONTEXT_SIZE);
+  for (i = CONTEXT_SIZE; i-- > 0; )
+    if (copy2[offset + i] != CONTEXT_BYTE(offset + i))
+      return "C";
+  for (i = 0; i < CONTEXT_SIZE; i += 0x1000)
+    array[offset + i] ^= 0xff;
+  delay_memcpy_destroy_context(context);
+  for (i = 0; i < CONTEXT_SIZE; i++)
+    if (copy[offset + i] != CONTEXT_BYTE(offset + i))
+      return "B";
+  return NULL;
+}
+
+/* Runs context_thread in several threads at once, whose faults are
+   resolved in parallel through /proc/self/mem. Returns 1 on
+   failure. */
+int test_contexts(void) {
+
+  pthread_t threads[CONTEXT_THREADS];
+  void *result;
+  size_t i;
+  int failed = 0;
+
+  printf("\nCopying lazily from %d threads, each in a context\n", CONTEXT_THREADS);
+  delay_memcpy_flush_all();
+  for (i = 0; i < CONTEXT_THREADS * CONTEXT_SIZE; i++)
+    array[i] = CONTEXT_BYTE(i);
+  for (i = 0; i < CONTEXT_THREADS; i++)
+    if (pthread_create(&threads[i], NULL, context_thread, (void *) i)) {
+      printf("Thread FAILED\n");
+      return 1;
+    }
+  for (i = 0; i < CONTEXT_THREADS; i++) {
+    pthread_join(threads[i], &result);
+    if (result) {
+      printf("Thread %zu: %s FAILED\n", i, (char *) result);
+      failed = 1;
+    }
+  }
+  printf("Destination B :");
+  print_array(copy + CONTEXT_SIZE, 20);
+  return failed;
+}
+
 int main(void) {
   srandom(time(NULL));
 
@@ -181,13 +856,73 @@ int main(void) {
   random_array(array, 0x1000);
   printf("Before copy: ");
   print_array(array, 20);
-  delay_memcpy(copy, array, 0x1000);
-  delay_memcpy(copy2, copy, 0x1000);
+  delay_memcpy_flags(copy, array, 0x1000, DELAY_MEMCPY_LAZY);
+  delay_memcpy_flags(copy2, copy, 0x1000, DELAY_MEMCPY_LAZY);
   printf("Destination C :");
-  print_array(copy2, 20);  // should trigger two copies
+  print_array(copy2, 20);  // copied straight from A, B remains pending
   printf("Destination B :");
   print_array(copy, 20);
 
+  printf("\nCopying A to B, filling part of A, then B to C in a batch and writing A\n");
+  delay_memcpy_flush_all();
+  random_array(array, 0x50000);
+  memcpy(copy2, array, 0x50000); // reference, copied with memmove and memset
+  delay_memcpy_flags(array + 6294, array + 75089, 22579, DELAY_MEMCPY_LAZY);
+  memmove(copy2 + 6294, copy2 + 75089, 22579);
+  delay_memset(array + 81648, 203, 13200);
+  memset(copy2 + 81648, 203, 13200);
+  delay_memcpy_vec_t batch = { array + 275031, array + 8822, 1692 };
+  delay_memcpy_v(&batch, 1, DELAY_MEMCPY_LAZY); // forwarded to the source of A to B
+  memmove(copy2 + 275031, copy2 + 8822, 1692);
+  for (int i = 73052; i < 85451; i++) {
+    array[i] ^= 64;
+    copy2[i] ^= 64;
+  }
+  delay_memcpy_flush_all();
+  printf("Destination C :");
+  print_array(array + 275031, 20);
+  printf("Expected      :");
+  print_array(copy2 + 275031, 20);
+  if (memcmp(array, copy2, 0x50000)) {
+    printf("Batch copy FAILED\n");
+    return 1;
+  }
+
+  if (test_read_fd_snapshot())
+    return 1;
+  if (test_zero_fill_shared())
+    return 1;
+  if (test_zero_pages())
+    return 1;
+  if (test_auto_mode())
+    return 1;
+  if (test_many_copies())
+    return 1;
+  if (test_remap())
+    return 1;
+  if (test_fault_ahead())
+    return 1;
+  if (test_granularity())
+    return 1;
+  if (test_sync_cancel())
+    return 1;
+  if (test_dead_copy())
+    return 1;
+  if (test_fan_out())
+    return 1;
+  if (test_parallel_flush())
+    return 1;
+  if (test_trace())
+    return 1;
+  if (test_preload())
+    return 1;
+  if (test_drain_start_stop())
+    return 1;
+  if (test_userfaultfd())
+    return 1;
+  if (test_contexts())
+    return 1;
+
   /* printf("\nCopying A to B to C\n"); */
   /* random_array(array, 0x1000); */
   /* printf("Before copy: "); */